@@ -0,0 +1,322 @@
+#pragma once
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "art.hpp"
+
+namespace arttree {
+
+/**
+ * \class Task
+ * \brief A coroutine running one tree operation under a Scheduler.
+ *
+ * The task starts suspended and suspends again every time it prefetched the
+ * next node, so the scheduler can run other tasks while the line arrives.
+ * Results are written through the references the operation was given.
+ */
+class Task {
+public:
+  struct promise_type {
+    Task get_return_object() {
+      return Task{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+
+    // frames are the same few sizes over and over, recycle them instead of
+    // going to the heap for every operation
+    static void *operator new(size_t size) { return frame_cache().get(size); }
+    static void operator delete(void *p, size_t size) {
+      frame_cache().put(p, size);
+    }
+  };
+
+  Task() = default;
+  Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      destroy();
+      handle_ = std::exchange(other.handle_, {});
+    }
+    return *this;
+  }
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+  ~Task() { destroy(); }
+
+  /**
+   * \brief Run the operation up to its next suspension point.
+   */
+  void resume() { handle_.resume(); }
+
+  /**
+   * \brief Check if the operation finished.
+   */
+  bool done() const { return !handle_ || handle_.done(); }
+
+private:
+  explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+  void destroy() {
+    if (handle_) {
+      handle_.destroy();
+      handle_ = {};
+    }
+  }
+
+  /**
+   * \struct FrameCache
+   * \brief Per-thread free lists of coroutine frames, one per 64-byte size
+   * class up to MAX_FRAME.
+   */
+  struct FrameCache {
+    static constexpr size_t CLASS_SIZE = 64;
+    static constexpr size_t MAX_FRAME = 1024;
+
+    std::vector<void *> free[MAX_FRAME / CLASS_SIZE];
+
+    ~FrameCache() {
+      for (auto &list : free) {
+        for (void *p : list) {
+          ::operator delete(p);
+        }
+      }
+    }
+
+    void *get(size_t size) {
+      if (size > MAX_FRAME) {
+        return ::operator new(size);
+      }
+      auto &list = free[(size - 1) / CLASS_SIZE];
+      if (list.empty()) {
+        return ::operator new(((size - 1) / CLASS_SIZE + 1) * CLASS_SIZE);
+      }
+      void *p = list.back();
+      list.pop_back();
+      return p;
+    }
+
+    void put(void *p, size_t size) {
+      if (size > MAX_FRAME) {
+        ::operator delete(p);
+        return;
+      }
+      free[(size - 1) / CLASS_SIZE].push_back(p);
+    }
+  };
+
+  static FrameCache &frame_cache() {
+    static thread_local FrameCache cache;
+    return cache;
+  }
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+/**
+ * \class Scheduler
+ * \brief Interleaves tree operations written as coroutines, so the cache
+ * misses of independent operations overlap.
+ *
+ * Every operation descends the tree one node at a time; after locating the
+ * next node it prefetches it and suspends, and the scheduler resumes the
+ * next task in the batch. Lookups, inserts and lower_bounds can be mixed in
+ * one run.
+ *
+ * All tasks run on the calling thread. An insert or lower_bound only walks
+ * its path to warm the cache and then runs the real operation without
+ * suspending. A lookup that was suspended across a change to the tree sees
+ * the tree's modification count move and restarts from the root.
+ */
+class Scheduler {
+public:
+  /**
+   * \brief Create a scheduler for a tree.
+   * \param tree The tree the operations run on.
+   * \param batch_size The number of operations in flight.
+   */
+  explicit Scheduler(ArtTree &tree,
+                     size_t batch_size = ArtTreeDefs::MULTI_SEARCH_GROUP)
+      : tree_(tree), batch_size_(batch_size ? batch_size : 1) {}
+
+  /**
+   * \brief Change the number of operations in flight, takes effect on the
+   * next run.
+   */
+  void set_batch_size(size_t batch_size) {
+    batch_size_ = batch_size ? batch_size : 1;
+  }
+
+  size_t batch_size() const { return batch_size_; }
+
+  /**
+   * \brief Look up a key.
+   * \param key The key, must stay valid until the task finished.
+   * \param out Receives the value, or std::nullopt if key is absent.
+   */
+  Task search(std::string_view key, std::optional<std::string_view> &out) {
+    const ArtTree &tree = tree_;
+    while (true) {
+      uint64_t version = tree.modification_count();
+      Descent d{tree.root(), 0, key};
+      while (d.step()) {
+        co_await Prefetch{d.cur};
+        if (tree.modification_count() != version) {
+          break;
+        }
+      }
+      if (tree.modification_count() != version) {
+        // a node on the path may be gone, start over
+        continue;
+      }
+      out = std::nullopt;
+      if (d.cur && Node::to_leaf(d.cur)->load_key() == key) {
+        out = Node::to_leaf(d.cur)->load_val();
+      }
+      co_return;
+    }
+  }
+
+  /**
+   * \brief Insert a key-value pair, or overwrite the value of an existing
+   * key. The path is prefetched first, the insert itself runs without
+   * suspending.
+   * \param key The key, must stay valid until the task finished.
+   * \param val The value, must stay valid until the task finished.
+   * \param created If not null, set to true if the key was created.
+   */
+  Task insert(std::string_view key, std::string_view val,
+              bool *created = nullptr) {
+    uint64_t version = tree_.modification_count();
+    for (Descent d{tree_.root(), 0, key}; d.step();) {
+      co_await Prefetch{d.cur};
+      if (tree_.modification_count() != version) {
+        break;
+      }
+    }
+    bool result = tree_.insert_or_assign(key, val);
+    if (created) {
+      *created = result;
+    }
+  }
+
+  /**
+   * \brief Find the first key not less than key. The path is prefetched
+   * first, the iterator is built without suspending.
+   * \param key The key, must stay valid until the task finished.
+   * \param out Receives the iterator.
+   */
+  Task lower_bound(std::string_view key, ArtTree::iterator &out) {
+    uint64_t version = tree_.modification_count();
+    for (Descent d{tree_.root(), 0, key}; d.step();) {
+      co_await Prefetch{d.cur};
+      if (tree_.modification_count() != version) {
+        break;
+      }
+    }
+    out = tree_.lower_bound(key);
+  }
+
+  /**
+   * \brief Run n operations, batch_size() of them in flight at a time.
+   * \param n The number of operations.
+   * \param make_task Called with 0..n-1 in order, returns the Task of that
+   * operation, for example a call to search() or insert().
+   */
+  template <typename MakeTask> void run(size_t n, MakeTask &&make_task) {
+    std::vector<Task> batch;
+    batch.reserve(std::min(n, batch_size_));
+    size_t next = 0;
+    for (; next < n && batch.size() < batch_size_; ++next) {
+      batch.push_back(make_task(next));
+    }
+    while (!batch.empty()) {
+      for (size_t i = 0; i < batch.size();) {
+        batch[i].resume();
+        if (!batch[i].done()) {
+          ++i;
+        } else if (next < n) {
+          batch[i] = make_task(next++);
+          ++i;
+        } else {
+          batch[i] = std::move(batch.back());
+          batch.pop_back();
+        }
+      }
+    }
+  }
+
+  /**
+   * \brief Look up a batch of keys.
+   * \param keys The keys.
+   * \param n The number of keys.
+   * \param out Receives the value of keys[i] in out[i], or std::nullopt.
+   */
+  void multi_search(const std::string_view *keys, size_t n,
+                    std::optional<std::string_view> *out) {
+    run(n, [&](size_t i) { return search(keys[i], out[i]); });
+  }
+
+  /**
+   * \brief Insert a batch of key-value pairs. Pairs with the same key
+   * may be applied in any order.
+   * \param kvs The key-value pairs.
+   * \param n The number of pairs.
+   */
+  void multi_insert(const std::pair<std::string_view, std::string_view> *kvs,
+                    size_t n) {
+    run(n, [&](size_t i) { return insert(kvs[i].first, kvs[i].second); });
+  }
+
+private:
+  /**
+   * \struct Prefetch
+   * \brief Awaitable that prefetches a node and suspends.
+   */
+  struct Prefetch {
+    const void *p;
+
+    bool await_ready() const noexcept {
+      prefetch(p);
+      return false;
+    }
+    void await_suspend(std::coroutine_handle<>) const noexcept {}
+    void await_resume() const noexcept {}
+  };
+
+  /**
+   * \struct Descent
+   * \brief The search path of a key, one inner node per step.
+   */
+  struct Descent {
+    Node *cur;
+    size_t depth;
+    std::string_view key;
+
+    /**
+     * \brief Move below the current inner node.
+     * \return False once cur is a leaf or the key is known to be absent
+     * (cur is nullptr then).
+     */
+    bool step() {
+      if (cur == nullptr || Node::is_leaf(cur)) {
+        return false;
+      }
+      cur = ArtTree::search_step(cur, depth, key);
+      return cur != nullptr;
+    }
+  };
+
+  ArtTree &tree_;
+  size_t batch_size_;
+};
+
+} // namespace arttree
@@ -0,0 +1,631 @@
+#pragma once
+
+#include <atomic>
+#include <string_view>
+
+#include "art.hpp"
+#include "epoch.hpp"
+
+namespace arttree {
+
+/**
+ * \struct OptLock
+ * \brief Optimistic lock operations on Node::version.
+ *
+ * Bit 0 marks a node obsolete (replaced and retired), bit 1 is the write
+ * lock and the other bits count write unlocks. A reader notes the version,
+ * reads the node without writing shared memory and validates afterwards
+ * that the version did not move. A writer upgrades a noted version to the
+ * lock with one compare-and-swap, so it also knows the node did not change
+ * since it was read. No operation blocks, a failed one asks the caller to
+ * restart.
+ */
+struct OptLock {
+  static constexpr uint64_t OBSOLETE = 1;
+  static constexpr uint64_t LOCKED = 2;
+
+  /**
+   * \brief Note the version of a node before reading it.
+   * \param n The node.
+   * \param restart Set when the node is locked or obsolete.
+   * \return The version to validate or upgrade with.
+   */
+  static uint64_t read_lock(const Node *n, bool &restart) {
+    uint64_t v = n->version.load(std::memory_order_acquire);
+    if (v & (OBSOLETE | LOCKED)) {
+      restart = true;
+    }
+    return v;
+  }
+
+  /**
+   * \brief Check that a node did not change since read_lock.
+   * \param n The node.
+   * \param v The version read_lock returned.
+   * \param restart Set when the node changed.
+   */
+  static void validate(const Node *n, uint64_t v, bool &restart) {
+    // the optimistic reads must complete before the version is read again
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (n->version.load(std::memory_order_relaxed) != v) {
+      restart = true;
+    }
+  }
+
+  /**
+   * \brief Take the write lock of a node unchanged since read_lock.
+   * \param n The node.
+   * \param v The version read_lock returned.
+   * \param restart Set when the node changed or is locked.
+   */
+  static void upgrade(Node *n, uint64_t v, bool &restart) {
+    if (!n->version.compare_exchange_strong(v, v + LOCKED,
+                                            std::memory_order_acquire)) {
+      restart = true;
+    }
+  }
+
+  /**
+   * \brief Take the write lock of a node in whatever version it is.
+   * \param n The node.
+   * \param restart Set when the node is locked or obsolete.
+   */
+  static void write_lock(Node *n, bool &restart) {
+    uint64_t v = read_lock(n, restart);
+    if (!restart) {
+      upgrade(n, v, restart);
+    }
+  }
+
+  static void write_unlock(Node *n) {
+    n->version.fetch_add(LOCKED, std::memory_order_release);
+  }
+
+  /**
+   * \brief Release the write lock of a node that was replaced. Readers
+   * that still reach it restart.
+   */
+  static void write_unlock_obsolete(Node *n) {
+    n->version.fetch_add(LOCKED + OBSOLETE, std::memory_order_release);
+  }
+};
+
+/**
+ * \class OlcArtTree
+ * \brief An ART that any number of threads can read and write at once,
+ * synchronized with optimistic lock coupling.
+ *
+ * Lookups take no locks and write no shared memory: they validate the
+ * version of every node they read and restart from the root when one
+ * moved. Writers lock only the nodes they change, the parent as well when
+ * a node is split, grown, shrunk or merged and so replaced in its slot.
+ *
+ * The root is a Node256 that is never replaced. Leaves are never changed
+ * once published, a new value gets a new leaf. Replaced nodes and leaves
+ * are retired to an EpochManager, since a reader may still be reading
+ * them, and freed once every thread moved past them. Nodes come from the
+ * Heap policy, which is safe to call from any thread.
+ */
+class OlcArtTree {
+public:
+  OlcArtTree() : alloc_(AllocPolicy::Heap) {
+    root_ = Node::make_node(NodeType::Node256, "", "", alloc_);
+  }
+
+  OlcArtTree(const OlcArtTree &) = delete;
+  OlcArtTree &operator=(const OlcArtTree &) = delete;
+
+  ~OlcArtTree() { destroy(root_); }
+
+  /**
+   * \brief Insert a key-value pair, or replace the value of an existing
+   * key.
+   * \param key The key.
+   * \param val The value.
+   * \return True if the key was created, false if it was assigned or is
+   * not a valid_key, which stores nothing.
+   */
+  bool insert(std::string_view key, std::string_view val) {
+    if (!valid_key(key)) {
+      return false;
+    }
+    auto guard = epoch_.pin();
+    while (true) {
+      bool restart = false;
+      bool created = try_insert(key, val, restart);
+      if (!restart) {
+        return created;
+      }
+    }
+  }
+
+  /**
+   * \brief Search for a key.
+   * \param key The key to search for.
+   * \param val The value, which stays readable while the calling thread
+   * holds a pin().
+   * \return True if the key was found, false otherwise.
+   */
+  bool search(std::string_view key, std::string_view &val) const {
+    auto guard = epoch_.pin();
+    while (true) {
+      bool restart = false;
+      bool found = try_search(key, val, restart);
+      if (!restart) {
+        return found;
+      }
+    }
+  }
+
+  /**
+   * \brief Remove a key.
+   * \param key The key to remove.
+   * \return True if the key was found and removed, false otherwise.
+   */
+  bool erase(std::string_view key) {
+    auto guard = epoch_.pin();
+    while (true) {
+      bool restart = false;
+      bool erased = try_erase(key, restart);
+      if (!restart) {
+        return erased;
+      }
+    }
+  }
+
+  /**
+   * \brief Pin the calling thread, so the nodes and values it reads stay
+   * allocated until the guard is destroyed.
+   */
+  EpochManager::Guard pin() const { return epoch_.pin(); }
+
+  /**
+   * \brief The number of keys in the tree.
+   */
+  size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+private:
+  bool try_search(std::string_view key, std::string_view &val,
+                  bool &restart) const;
+  bool try_insert(std::string_view key, std::string_view val, bool &restart);
+  bool try_erase(std::string_view key, bool &restart);
+
+  /**
+   * \brief Compare the full prefix of a node, reading bytes past
+   * MAX_PREFIX_LEN from a leaf below it. The result is only meaningful
+   * once the node's version is validated.
+   * \param n The node.
+   * \param key The key.
+   * \param depth The depth of n.
+   * \param leaf_key Set to the key of that leaf if one was needed.
+   * \param restart Set when a node on the way to the leaf changed.
+   * \return The length of the matching prefix.
+   */
+  size_t prefix_mismatch(Node *n, std::string_view key, size_t depth,
+                         std::string_view &leaf_key, bool &restart) const {
+    size_t p = n->check_prefix(key, depth);
+    if (p < n->stored_prefix_len() ||
+        n->prefix_len <= ArtTreeDefs::MAX_PREFIX_LEN) {
+      return p;
+    }
+    NodeLeaf *leaf = any_leaf(n, restart);
+    if (restart) {
+      return 0;
+    }
+    leaf_key = leaf->load_key();
+    if (leaf_key.size() < depth) {
+      restart = true;
+      return 0;
+    }
+    size_t max_cmp = std::min<size_t>(
+        n->prefix_len, std::min(leaf_key.size(), key.size()) - depth);
+    for (; p < max_cmp && leaf_key[depth + p] == key[depth + p]; ++p) {
+    }
+    return p;
+  }
+
+  /**
+   * \brief Find some leaf below a node, validating every node on the way.
+   */
+  NodeLeaf *any_leaf(Node *n, bool &restart) const {
+    while (true) {
+      uint64_t v = OptLock::read_lock(n, restart);
+      if (restart) {
+        return nullptr;
+      }
+      Node *child = first_child(n);
+      OptLock::validate(n, v, restart);
+      if (restart) {
+        return nullptr;
+      }
+      if (child == nullptr) {
+        restart = true;
+        return nullptr;
+      }
+      if (Node::is_leaf(child)) {
+        return Node::to_leaf(child);
+      }
+      n = child;
+    }
+  }
+
+  /**
+   * \brief Node::first_child for a node that may change while it is read:
+   * every slot is read once, a torn result is caught by validation.
+   */
+  static Node *first_child(Node *n) {
+    switch (n->type) {
+    case NodeType::Node4:
+      return n->as<Node4>()->children[0];
+    case NodeType::Node16:
+      return n->as<Node16>()->children[0];
+    case NodeType::Node48: {
+      auto *n48 = n->as<Node48>();
+      for (size_t i = 0; i < 256; ++i) {
+        int8_t index = n48->child_index[i];
+        if (index >= 0) {
+          return n48->children[index];
+        }
+      }
+      return nullptr;
+    }
+    case NodeType::Node256: {
+      auto *n256 = n->as<Node256>();
+      for (size_t i = 0; i < 256; ++i) {
+        if (Node *child = n256->children[i]) {
+          return child;
+        }
+      }
+      return nullptr;
+    }
+    default:
+      assert(false && "Invalid node type");
+    }
+    return nullptr;
+  }
+
+  /**
+   * \brief Point the slot of ch in a locked node at another child.
+   */
+  static void replace_child(Node *n, unsigned char ch, Node *child) {
+    Node **slot = n->find_child(ch);
+    assert(slot != nullptr);
+    *slot = child;
+  }
+
+  /**
+   * \brief Free a replaced node or leaf once no reader can hold it.
+   */
+  void retire(Node *n) { epoch_.retire(n); }
+
+  void destroy(Node *cur) {
+    if (!Node::is_leaf(cur)) {
+      cur->for_each_child(
+          [this](Node *child, unsigned char) { destroy(child); });
+    }
+    Node::free_node(cur, alloc_);
+  }
+
+  NodeAllocator alloc_;
+  Node *root_;
+  std::atomic<size_t> size_{0};
+  // declared after alloc_, frees what is still retired before it goes
+  EpochManager epoch_{alloc_};
+};
+
+inline bool OlcArtTree::try_search(std::string_view key, std::string_view &val,
+                                   bool &restart) const {
+  Node *node = root_;
+  uint64_t v = OptLock::read_lock(node, restart);
+  if (restart) {
+    return false;
+  }
+  size_t depth = 0;
+  while (true) {
+    // optimistic: bytes past MAX_PREFIX_LEN are verified at the leaf
+    bool match = node->check_prefix(key, depth) == node->stored_prefix_len();
+    depth += node->prefix_len;
+    Node *next = nullptr;
+    if (match && depth <= key.size()) {
+      Node **slot = node->find_child(key_byte(key, depth));
+      next = slot ? *slot : nullptr;
+    }
+    // nothing read from node is trusted, let alone followed, before this
+    OptLock::validate(node, v, restart);
+    if (restart || next == nullptr) {
+      return false;
+    }
+    if (Node::is_leaf(next)) {
+      NodeLeaf *leaf = Node::to_leaf(next);
+      if (leaf->load_key() != key) {
+        return false;
+      }
+      val = leaf->load_val();
+      return true;
+    }
+    uint64_t next_v = OptLock::read_lock(next, restart);
+    // a split or merge may have rewritten next's prefix in place since node
+    // was validated, it changes node's version too
+    OptLock::validate(node, v, restart);
+    if (restart) {
+      return false;
+    }
+    node = next;
+    v = next_v;
+    depth++;
+  }
+}
+
+inline bool OlcArtTree::try_insert(std::string_view key, std::string_view val,
+                                   bool &restart) {
+  Node *parent = nullptr;
+  uint64_t parent_v = 0;
+  unsigned char parent_ch = 0;
+  Node *node = root_;
+  uint64_t v = OptLock::read_lock(node, restart);
+  if (restart) {
+    return false;
+  }
+  size_t depth = 0;
+
+  while (true) {
+    std::string_view leaf_key;
+    size_t p = prefix_mismatch(node, key, depth, leaf_key, restart);
+    size_t prefix_len = node->prefix_len;
+    if (!restart && p != prefix_len &&
+        prefix_len > ArtTreeDefs::MAX_PREFIX_LEN && leaf_key.empty()) {
+      // the bytes after the split point may not be stored
+      NodeLeaf *leaf = any_leaf(node, restart);
+      leaf_key = restart ? std::string_view{} : leaf->load_key();
+    }
+    if (restart) {
+      return false;
+    }
+    OptLock::validate(node, v, restart);
+    if (restart) {
+      return false;
+    }
+
+    if (p != prefix_len) {
+      // split the prefix at p; the root has none, so there is a parent
+      OptLock::upgrade(parent, parent_v, restart);
+      if (restart) {
+        return false;
+      }
+      OptLock::upgrade(node, v, restart);
+      if (restart) {
+        OptLock::write_unlock(parent);
+        return false;
+      }
+      Node *new_node = Node::make_node(NodeType::Node4, "", "", alloc_);
+      new_node->set_prefix(node->prefix, p);
+      if (prefix_len <= ArtTreeDefs::MAX_PREFIX_LEN) {
+        new_node->add_child(node->prefix[p], node);
+        node->prefix_len -= p + 1;
+        memmove(node->prefix, node->prefix + p + 1, node->stored_prefix_len());
+      } else {
+        new_node->add_child(key_byte(leaf_key, depth + p), node);
+        node->prefix_len -= p + 1;
+        memcpy(node->prefix, leaf_key.data() + depth + p + 1,
+               node->stored_prefix_len());
+      }
+      new_node->add_child(key_byte(key, depth + p),
+                          Node::make_node(NodeType::Leaf, key, val, alloc_));
+      replace_child(parent, parent_ch, new_node);
+      OptLock::write_unlock(node);
+      OptLock::write_unlock(parent);
+      size_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+
+    depth += prefix_len;
+    unsigned char ch = key_byte(key, depth);
+    Node **slot = node->find_child(ch);
+    Node *next = slot ? *slot : nullptr;
+    OptLock::validate(node, v, restart);
+    if (restart) {
+      return false;
+    }
+
+    if (next == nullptr) {
+      if (node->is_full()) {
+        // grow: the larger copy replaces node in its parent
+        OptLock::upgrade(parent, parent_v, restart);
+        if (restart) {
+          return false;
+        }
+        OptLock::upgrade(node, v, restart);
+        if (restart) {
+          OptLock::write_unlock(parent);
+          return false;
+        }
+        NodeType type = node->type == NodeType::Node4    ? NodeType::Node16
+                        : node->type == NodeType::Node16 ? NodeType::Node48
+                                                         : NodeType::Node256;
+        Node *grown = Node::copy_as(node, type, alloc_);
+        grown->add_child(ch, Node::make_node(NodeType::Leaf, key, val, alloc_));
+        replace_child(parent, parent_ch, grown);
+        OptLock::write_unlock(parent);
+        OptLock::write_unlock_obsolete(node);
+        retire(node);
+      } else {
+        OptLock::upgrade(node, v, restart);
+        if (restart) {
+          return false;
+        }
+        node->add_child(ch, Node::make_node(NodeType::Leaf, key, val, alloc_));
+        OptLock::write_unlock(node);
+      }
+      size_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+
+    if (Node::is_leaf(next)) {
+      std::string_view key2 = Node::to_leaf(next)->load_key();
+      OptLock::upgrade(node, v, restart);
+      if (restart) {
+        return false;
+      }
+      if (key2 == key) {
+        // leaves are immutable, readers may be reading the old one
+        *slot = Node::make_node(NodeType::Leaf, key, val, alloc_);
+        OptLock::write_unlock(node);
+        retire(next);
+        return false;
+      }
+      // both keys go below a new Node4 holding their common prefix
+      size_t leaf_depth = depth + 1;
+      size_t limit = std::min(key.size(), key2.size());
+      size_t i = leaf_depth;
+      for (; i < limit && key[i] == key2[i]; i++) {
+      }
+      Node *new_node = Node::make_node(NodeType::Node4, "", "", alloc_);
+      new_node->set_prefix((const unsigned char *)key.data() + leaf_depth,
+                           i - leaf_depth);
+      new_node->add_child(key_byte(key, i),
+                          Node::make_node(NodeType::Leaf, key, val, alloc_));
+      new_node->add_child(key_byte(key2, i), next);
+      *slot = new_node;
+      OptLock::write_unlock(node);
+      size_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+
+    uint64_t next_v = OptLock::read_lock(next, restart);
+    // see try_search: node is checked again once next's version is held
+    OptLock::validate(node, v, restart);
+    if (restart) {
+      return false;
+    }
+    parent = node;
+    parent_v = v;
+    parent_ch = ch;
+    node = next;
+    v = next_v;
+    depth++;
+  }
+}
+
+inline bool OlcArtTree::try_erase(std::string_view key, bool &restart) {
+  Node *parent = nullptr;
+  uint64_t parent_v = 0;
+  unsigned char parent_ch = 0;
+  Node *node = root_;
+  uint64_t v = OptLock::read_lock(node, restart);
+  if (restart) {
+    return false;
+  }
+  size_t depth = 0;
+
+  while (true) {
+    bool match = node->check_prefix(key, depth) == node->stored_prefix_len();
+    depth += node->prefix_len;
+    unsigned char ch = key_byte(key, depth);
+    Node **slot = nullptr;
+    Node *next = nullptr;
+    if (match && depth <= key.size()) {
+      slot = node->find_child(ch);
+      next = slot ? *slot : nullptr;
+    }
+    OptLock::validate(node, v, restart);
+    if (restart || next == nullptr) {
+      return false;
+    }
+
+    if (!Node::is_leaf(next)) {
+      uint64_t next_v = OptLock::read_lock(next, restart);
+      OptLock::validate(node, v, restart);
+      if (restart) {
+        return false;
+      }
+      parent = node;
+      parent_v = v;
+      parent_ch = ch;
+      node = next;
+      v = next_v;
+      depth++;
+      continue;
+    }
+
+    if (Node::to_leaf(next)->load_key() != key) {
+      return false;
+    }
+
+    size_t left = node->num_children - 1;
+    bool shrink = false;
+    NodeType smaller = NodeType::Invalid;
+    if (node != root_) {
+      switch (node->type) {
+      case NodeType::Node4:
+        shrink = left == 1;
+        break;
+      case NodeType::Node16:
+        shrink = left <= ArtTreeDefs::NODE16_SHRINK;
+        smaller = NodeType::Node4;
+        break;
+      case NodeType::Node48:
+        shrink = left <= ArtTreeDefs::NODE48_SHRINK;
+        smaller = NodeType::Node16;
+        break;
+      case NodeType::Node256:
+        shrink = left <= ArtTreeDefs::NODE256_SHRINK;
+        smaller = NodeType::Node48;
+        break;
+      default:
+        assert(false && "Invalid node type");
+      }
+    }
+
+    if (!shrink) {
+      OptLock::upgrade(node, v, restart);
+      if (restart) {
+        return false;
+      }
+      node->remove_child(ch);
+      OptLock::write_unlock(node);
+      retire(next);
+      size_.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+
+    OptLock::upgrade(parent, parent_v, restart);
+    if (restart) {
+      return false;
+    }
+    OptLock::upgrade(node, v, restart);
+    if (restart) {
+      OptLock::write_unlock(parent);
+      return false;
+    }
+    Node *replacement;
+    if (node->type == NodeType::Node4) {
+      // path compression: the remaining child takes node's place
+      auto *n4 = node->as<Node4>();
+      size_t other = n4->key[0] == ch ? 1 : 0;
+      replacement = n4->children[other];
+      if (!Node::is_leaf(replacement)) {
+        // its prefix changes in place, readers inside it must notice
+        OptLock::write_lock(replacement, restart);
+        if (restart) {
+          OptLock::write_unlock(node);
+          OptLock::write_unlock(parent);
+          return false;
+        }
+        Node::prepend_prefix(node, n4->key[other], replacement);
+        OptLock::write_unlock(replacement);
+      }
+    } else {
+      node->remove_child(ch);
+      replacement = Node::copy_as(node, smaller, alloc_);
+    }
+    replace_child(parent, parent_ch, replacement);
+    OptLock::write_unlock(parent);
+    OptLock::write_unlock_obsolete(node);
+    retire(node);
+    retire(next);
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+}
+
+} // namespace arttree
@@ -0,0 +1,628 @@
+#pragma once
+
+#include <atomic>
+#include <string_view>
+#include <thread>
+
+#include "art_olc.hpp"
+
+namespace arttree {
+
+class MvccArtTree;
+
+/**
+ * \class RowexArtTree
+ * \brief An ART with wait-free lookups, synchronized with ROWEX (read
+ * optimized write exclusion).
+ *
+ * Readers take no locks and never restart: every node they can reach is
+ * consistent at all times. Writers lock the nodes they change with the
+ * write lock bit of Node::version and keep that guarantee:
+ *
+ * - Child slots are read and written atomically. A Node48 publishes a new
+ *   child's pointer before its child_index entry, so a reader sees the
+ *   child either completely or not at all.
+ * - Node4 and Node16 keep their keys sorted by shifting, which readers
+ *   could observe half done, so they are copy-on-write: a change builds a
+ *   new node and swaps it into the parent's slot. The same goes for every
+ *   prefix change and every grow, shrink or merge.
+ * - Leaves are never changed once published.
+ *
+ * Writers walk down like readers, then lock top-down (the parent first
+ * when the node is replaced) and check that what they saw still holds;
+ * only writers ever restart. Replaced nodes and leaves are retired to an
+ * EpochManager and freed once no reader can hold them.
+ *
+ * Compared to OlcArtTree, lookups cost a few atomic loads more but never
+ * repeat, and writers pay for copying small nodes.
+ */
+class RowexArtTree {
+  friend class MvccArtTree;
+
+public:
+  RowexArtTree() : alloc_(AllocPolicy::Heap) {
+    root_ = Node::make_node(NodeType::Node256, "", "", alloc_);
+  }
+
+  RowexArtTree(const RowexArtTree &) = delete;
+  RowexArtTree &operator=(const RowexArtTree &) = delete;
+
+  ~RowexArtTree() { destroy(root_); }
+
+  /**
+   * \brief Insert a key-value pair, or replace the value of an existing
+   * key.
+   * \param key The key.
+   * \param val The value.
+   * \return True if the key was created, false if it was assigned or is
+   * not a valid_key, which stores nothing.
+   */
+  bool insert(std::string_view key, std::string_view val) {
+    if (!valid_key(key)) {
+      return false;
+    }
+    auto guard = epoch_.pin();
+    while (true) {
+      bool restart = false;
+      bool created = try_insert(key, val, true, restart);
+      if (!restart) {
+        return created;
+      }
+    }
+  }
+
+  /**
+   * \brief Insert a key-value pair if the key is not present yet.
+   * \param key The key.
+   * \param val The value.
+   * \return True if the key was created, false if it already existed or
+   * is not a valid_key, which stores nothing.
+   */
+  bool insert_if_absent(std::string_view key, std::string_view val) {
+    if (!valid_key(key)) {
+      return false;
+    }
+    auto guard = epoch_.pin();
+    while (true) {
+      bool restart = false;
+      bool created = try_insert(key, val, false, restart);
+      if (!restart) {
+        return created;
+      }
+    }
+  }
+
+  /**
+   * \brief Search for a key. Never blocks or retries.
+   * \param key The key to search for.
+   * \param val The value, which stays readable while the calling thread
+   * holds a pin().
+   * \return True if the key was found, false otherwise.
+   */
+  bool search(std::string_view key, std::string_view &val) const;
+
+  /**
+   * \brief Remove a key.
+   * \param key The key to remove.
+   * \return True if the key was found and removed, false otherwise.
+   */
+  bool erase(std::string_view key) {
+    auto guard = epoch_.pin();
+    while (true) {
+      bool restart = false;
+      bool erased = try_erase(key, restart);
+      if (!restart) {
+        return erased;
+      }
+    }
+  }
+
+  /**
+   * \brief Pin the calling thread, so the nodes and values it reads stay
+   * allocated until the guard is destroyed.
+   */
+  EpochManager::Guard pin() const { return epoch_.pin(); }
+
+  /**
+   * \brief The number of keys in the tree.
+   */
+  size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+private:
+  bool try_insert(std::string_view key, std::string_view val, bool assign,
+                  bool &restart);
+  bool try_erase(std::string_view key, bool &restart);
+
+  static Node *load(Node *const &slot) {
+    return std::atomic_ref<Node *const>(slot).load(std::memory_order_acquire);
+  }
+
+  static void store(Node *&slot, Node *n) {
+    std::atomic_ref<Node *>(slot).store(n, std::memory_order_release);
+  }
+
+  /**
+   * \brief Find the slot of a child; reads only what writers publish
+   * atomically, so it is safe without the node's lock.
+   * \param n The node.
+   * \param ch The key byte.
+   * \return The slot, or nullptr if there is no child under ch.
+   */
+  static Node **find_slot(Node *n, unsigned char ch) {
+    switch (n->type) {
+    case NodeType::Node4:
+      // immutable once published
+      return n->as<Node4>()->find_child(ch);
+    case NodeType::Node16:
+      return n->as<Node16>()->find_child(ch);
+    case NodeType::Node48: {
+      auto *n48 = n->as<Node48>();
+      int8_t index = std::atomic_ref<int8_t>(n48->child_index[ch]).load(
+          std::memory_order_acquire);
+      return index < 0 ? nullptr : &n48->children[index];
+    }
+    case NodeType::Node256:
+      return &n->as<Node256>()->children[ch];
+    default:
+      assert(false && "Invalid node type");
+    }
+    return nullptr;
+  }
+
+  static Node *find_child(Node *n, unsigned char ch) {
+    Node **slot = find_slot(n, ch);
+    return slot ? load(*slot) : nullptr;
+  }
+
+  /**
+   * \brief Find some leaf below a node for the prefix bytes past
+   * MAX_PREFIX_LEN.
+   * \return The leaf, or nullptr if a node on the way was emptied.
+   */
+  static NodeLeaf *any_leaf(Node *n) {
+    while (!Node::is_leaf(n)) {
+      Node *child = nullptr;
+      switch (n->type) {
+      case NodeType::Node4:
+      case NodeType::Node16:
+        child = find_child(n, n->type == NodeType::Node4
+                                  ? n->as<Node4>()->key[0]
+                                  : n->as<Node16>()->key[0]);
+        break;
+      case NodeType::Node48:
+      case NodeType::Node256:
+        for (size_t i = 0; i < 256 && child == nullptr; ++i) {
+          child = find_child(n, static_cast<unsigned char>(i));
+        }
+        break;
+      default:
+        assert(false && "Invalid node type");
+      }
+      if (child == nullptr) {
+        return nullptr;
+      }
+      n = child;
+    }
+    return Node::to_leaf(n);
+  }
+
+  /**
+   * \brief Lock a node, waiting for other writers.
+   * \return False, with the node unlocked, if the node was replaced.
+   */
+  static bool lock(Node *n) {
+    while (true) {
+      uint64_t v = n->version.load(std::memory_order_acquire);
+      if (v & OptLock::OBSOLETE) {
+        return false;
+      }
+      if (!(v & OptLock::LOCKED) &&
+          n->version.compare_exchange_weak(v, v + OptLock::LOCKED,
+                                           std::memory_order_acquire)) {
+        return true;
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  /**
+   * \brief Lock a parent and check that its slot for ch still holds node.
+   */
+  static bool lock_parent(Node *parent, unsigned char ch, Node *node) {
+    if (!lock(parent)) {
+      return false;
+    }
+    if (find_child(parent, ch) != node) {
+      OptLock::write_unlock(parent);
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * \brief Swap node for its replacement in the locked parent, then
+   * release both and retire node.
+   */
+  void replace(Node *parent, unsigned char ch, Node *node, Node *replacement) {
+    store(*find_slot(parent, ch), replacement);
+    OptLock::write_unlock(parent);
+    OptLock::write_unlock_obsolete(node);
+    retire(node);
+  }
+
+  /**
+   * \brief Add a child to a locked Node48 or Node256 in place.
+   */
+  static void publish_child(Node *n, unsigned char ch, Node *child) {
+    if (n->type == NodeType::Node256) {
+      store(n->as<Node256>()->children[ch], child);
+    } else {
+      auto *n48 = n->as<Node48>();
+      int8_t index = 0;
+      while (n48->children[index] != nullptr) {
+        index++;
+      }
+      // the pointer first, a reader that finds the index finds the child
+      store(n48->children[index], child);
+      std::atomic_ref<int8_t>(n48->child_index[ch])
+          .store(index, std::memory_order_release);
+    }
+    n->num_children++;
+  }
+
+  /**
+   * \brief Remove a child from a locked Node48 or Node256 in place.
+   */
+  static void unpublish_child(Node *n, unsigned char ch) {
+    if (n->type == NodeType::Node256) {
+      store(n->as<Node256>()->children[ch], nullptr);
+    } else {
+      auto *n48 = n->as<Node48>();
+      int8_t index = n48->child_index[ch];
+      std::atomic_ref<int8_t>(n48->child_index[ch])
+          .store(-1, std::memory_order_release);
+      store(n48->children[index], nullptr);
+    }
+    n->num_children--;
+  }
+
+  void retire(Node *n) { epoch_.retire(n); }
+
+  void destroy(Node *cur) {
+    if (!Node::is_leaf(cur)) {
+      cur->for_each_child(
+          [this](Node *child, unsigned char) { destroy(child); });
+    }
+    Node::free_node(cur, alloc_);
+  }
+
+  NodeAllocator alloc_;
+  Node *root_;
+  std::atomic<size_t> size_{0};
+  // declared after alloc_, frees what is still retired before it goes
+  EpochManager epoch_{alloc_};
+};
+
+inline bool RowexArtTree::search(std::string_view key,
+                                 std::string_view &val) const {
+  auto guard = epoch_.pin();
+  Node *node = root_;
+  size_t depth = 0;
+  while (true) {
+    // optimistic: bytes past MAX_PREFIX_LEN are verified at the leaf
+    if (node->check_prefix(key, depth) != node->stored_prefix_len()) {
+      return false;
+    }
+    depth += node->prefix_len;
+    if (depth > key.size()) {
+      return false;
+    }
+    Node *next = find_child(node, key_byte(key, depth));
+    if (next == nullptr) {
+      return false;
+    }
+    if (Node::is_leaf(next)) {
+      NodeLeaf *leaf = Node::to_leaf(next);
+      if (leaf->load_key() != key) {
+        return false;
+      }
+      val = leaf->load_val();
+      return true;
+    }
+    node = next;
+    depth++;
+  }
+}
+
+inline bool RowexArtTree::try_insert(std::string_view key,
+                                     std::string_view val, bool assign,
+                                     bool &restart) {
+  Node *parent = nullptr;
+  unsigned char parent_ch = 0;
+  Node *node = root_;
+  size_t depth = 0;
+
+  while (true) {
+    // prefixes never change in place, no lock needed to read them
+    size_t p = node->check_prefix(key, depth);
+    std::string_view leaf_key;
+    if (node->prefix_len > ArtTreeDefs::MAX_PREFIX_LEN) {
+      NodeLeaf *leaf = any_leaf(node);
+      if (leaf == nullptr) {
+        restart = true;
+        return false;
+      }
+      leaf_key = leaf->load_key();
+      if (p == node->stored_prefix_len()) {
+        size_t max_cmp = std::min<size_t>(
+            node->prefix_len, std::min(leaf_key.size(), key.size()) - depth);
+        for (; p < max_cmp && leaf_key[depth + p] == key[depth + p]; ++p) {
+        }
+      }
+    }
+
+    if (p != node->prefix_len) {
+      // split the prefix at p; node is replaced by a copy with the rest of
+      // its prefix. The root has no prefix, so there is a parent.
+      if (!lock_parent(parent, parent_ch, node)) {
+        restart = true;
+        return false;
+      }
+      if (!lock(node)) {
+        OptLock::write_unlock(parent);
+        restart = true;
+        return false;
+      }
+      Node *rest = Node::copy_as(node, node->type, alloc_);
+      unsigned char rest_ch;
+      rest->prefix_len -= p + 1;
+      if (node->prefix_len <= ArtTreeDefs::MAX_PREFIX_LEN) {
+        rest_ch = node->prefix[p];
+        memmove(rest->prefix, node->prefix + p + 1, rest->stored_prefix_len());
+      } else {
+        rest_ch = key_byte(leaf_key, depth + p);
+        memcpy(rest->prefix, leaf_key.data() + depth + p + 1,
+               rest->stored_prefix_len());
+      }
+      Node *new_node = Node::make_node(NodeType::Node4, "", "", alloc_);
+      new_node->set_prefix(node->prefix, p);
+      new_node->add_child(rest_ch, rest);
+      new_node->add_child(key_byte(key, depth + p),
+                          Node::make_node(NodeType::Leaf, key, val, alloc_));
+      replace(parent, parent_ch, node, new_node);
+      size_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+
+    depth += node->prefix_len;
+    unsigned char ch = key_byte(key, depth);
+    Node *next = find_child(node, ch);
+
+    if (next == nullptr) {
+      if (node->type == NodeType::Node48 || node->type == NodeType::Node256) {
+        if (!lock(node)) {
+          restart = true;
+          return false;
+        }
+        if (find_child(node, ch) != nullptr) {
+          OptLock::write_unlock(node);
+          restart = true;
+          return false;
+        }
+        if (!node->is_full()) {
+          publish_child(node, ch,
+                        Node::make_node(NodeType::Leaf, key, val, alloc_));
+          OptLock::write_unlock(node);
+          size_.fetch_add(1, std::memory_order_relaxed);
+          return true;
+        }
+        // a full Node48 grows, which needs the parent first
+        OptLock::write_unlock(node);
+      }
+
+      // copy-on-write, into the next larger type when full
+      if (!lock_parent(parent, parent_ch, node)) {
+        restart = true;
+        return false;
+      }
+      if (!lock(node)) {
+        OptLock::write_unlock(parent);
+        restart = true;
+        return false;
+      }
+      if (find_child(node, ch) != nullptr) {
+        OptLock::write_unlock(node);
+        OptLock::write_unlock(parent);
+        restart = true;
+        return false;
+      }
+      NodeType type = node->type;
+      if (node->is_full()) {
+        type = type == NodeType::Node4    ? NodeType::Node16
+               : type == NodeType::Node16 ? NodeType::Node48
+                                          : NodeType::Node256;
+      }
+      Node *copy = Node::copy_as(node, type, alloc_);
+      copy->add_child(ch, Node::make_node(NodeType::Leaf, key, val, alloc_));
+      replace(parent, parent_ch, node, copy);
+      size_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+
+    if (Node::is_leaf(next)) {
+      if (!lock(node)) {
+        restart = true;
+        return false;
+      }
+      Node **slot = find_slot(node, ch);
+      if (slot == nullptr || *slot != next) {
+        OptLock::write_unlock(node);
+        restart = true;
+        return false;
+      }
+      std::string_view key2 = Node::to_leaf(next)->load_key();
+      if (key2 == key && !assign) {
+        OptLock::write_unlock(node);
+        return false;
+      }
+      if (key2 == key) {
+        store(*slot, Node::make_node(NodeType::Leaf, key, val, alloc_));
+        OptLock::write_unlock(node);
+        retire(next);
+        return false;
+      }
+      // a single pointer store, safe even in a Node4 or Node16
+      size_t leaf_depth = depth + 1;
+      size_t limit = std::min(key.size(), key2.size());
+      size_t i = leaf_depth;
+      for (; i < limit && key[i] == key2[i]; i++) {
+      }
+      Node *new_node = Node::make_node(NodeType::Node4, "", "", alloc_);
+      new_node->set_prefix((const unsigned char *)key.data() + leaf_depth,
+                           i - leaf_depth);
+      new_node->add_child(key_byte(key, i),
+                          Node::make_node(NodeType::Leaf, key, val, alloc_));
+      new_node->add_child(key_byte(key2, i), next);
+      store(*slot, new_node);
+      OptLock::write_unlock(node);
+      size_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+
+    parent = node;
+    parent_ch = ch;
+    node = next;
+    depth++;
+  }
+}
+
+inline bool RowexArtTree::try_erase(std::string_view key, bool &restart) {
+  Node *parent = nullptr;
+  unsigned char parent_ch = 0;
+  Node *node = root_;
+  size_t depth = 0;
+
+  while (true) {
+    if (node->check_prefix(key, depth) != node->stored_prefix_len()) {
+      return false;
+    }
+    depth += node->prefix_len;
+    if (depth > key.size()) {
+      return false;
+    }
+    unsigned char ch = key_byte(key, depth);
+    Node *next = find_child(node, ch);
+    if (next == nullptr) {
+      return false;
+    }
+    if (!Node::is_leaf(next)) {
+      parent = node;
+      parent_ch = ch;
+      node = next;
+      depth++;
+      continue;
+    }
+    if (Node::to_leaf(next)->load_key() != key) {
+      return false;
+    }
+
+    bool small = node->type == NodeType::Node4 || node->type == NodeType::Node16;
+    if (node == root_ || !small) {
+      if (!lock(node)) {
+        restart = true;
+        return false;
+      }
+      if (find_child(node, ch) != next) {
+        OptLock::write_unlock(node);
+        restart = true;
+        return false;
+      }
+      size_t left = node->num_children - 1;
+      bool shrink = node != root_ &&
+                    (node->type == NodeType::Node48
+                         ? left <= ArtTreeDefs::NODE48_SHRINK
+                         : left <= ArtTreeDefs::NODE256_SHRINK);
+      if (!shrink) {
+        unpublish_child(node, ch);
+        OptLock::write_unlock(node);
+        retire(next);
+        size_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+      }
+      // shrinking replaces the node, which needs the parent first
+      OptLock::write_unlock(node);
+    }
+
+    if (!lock_parent(parent, parent_ch, node)) {
+      restart = true;
+      return false;
+    }
+    if (!lock(node)) {
+      OptLock::write_unlock(parent);
+      restart = true;
+      return false;
+    }
+    if (find_child(node, ch) != next) {
+      OptLock::write_unlock(node);
+      OptLock::write_unlock(parent);
+      restart = true;
+      return false;
+    }
+
+    Node *replacement;
+    Node *retired_child = nullptr;
+    if (node->type == NodeType::Node4 && node->num_children == 2) {
+      // path compression: the other child takes node's place, with node's
+      // prefix in front of its own
+      auto *n4 = node->as<Node4>();
+      size_t other = n4->key[0] == ch ? 1 : 0;
+      Node *child = n4->children[other];
+      replacement = child;
+      if (!Node::is_leaf(child)) {
+        if (!lock(child)) {
+          OptLock::write_unlock(node);
+          OptLock::write_unlock(parent);
+          restart = true;
+          return false;
+        }
+        replacement = Node::copy_as(child, child->type, alloc_);
+        Node::prepend_prefix(node, n4->key[other], replacement);
+        retired_child = child;
+      }
+    } else {
+      size_t left = node->num_children - 1;
+      NodeType type = node->type;
+      switch (type) {
+      case NodeType::Node16:
+        type = left <= ArtTreeDefs::NODE16_SHRINK ? NodeType::Node4 : type;
+        break;
+      case NodeType::Node48:
+        type = left <= ArtTreeDefs::NODE48_SHRINK ? NodeType::Node16 : type;
+        break;
+      case NodeType::Node256:
+        type = left <= ArtTreeDefs::NODE256_SHRINK ? NodeType::Node48 : type;
+        break;
+      default:
+        break;
+      }
+      // copy everything but the erased leaf
+      replacement = Node::make_node(type, "", "", alloc_);
+      replacement->set_prefix(node->prefix, node->prefix_len);
+      node->for_each_child([&](Node *child, unsigned char c) {
+        if (c != ch) {
+          replacement->add_child(c, child);
+        }
+      });
+    }
+    replace(parent, parent_ch, node, replacement);
+    if (retired_child) {
+      OptLock::write_unlock_obsolete(retired_child);
+      retire(retired_child);
+    }
+    retire(next);
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+}
+
+} // namespace arttree
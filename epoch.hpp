@@ -0,0 +1,347 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "art.hpp"
+
+namespace arttree {
+
+/**
+ * \class EpochManager
+ * \brief Epoch-based reclamation of the nodes and leaves a concurrent tree
+ * replaced or removed.
+ *
+ * A thread pins the manager around every operation that reads nodes. A
+ * pinned thread announces the global epoch it saw; the global epoch only
+ * moves on once every pinned thread announced the current one. A node
+ * retired in epoch e can only be held by a thread pinned in epoch e + 1 or
+ * earlier, so once the global epoch reached e + 3 it goes back to the
+ * allocator.
+ *
+ * Pinning is a store to a slot owned by the thread, no shared cache line
+ * is written. Every thread queues what it retires on its own list and
+ * frees from that list itself, every RECLAIM_THRESHOLD retirements. When a
+ * thread exits, what it retired and did not free yet moves to a shared
+ * list that the next reclaim() on any thread drains, and its record is
+ * dropped, so threads coming and going do not pile up.
+ *
+ * Blocks are freed from whatever thread retired them, so the allocator
+ * must be thread safe, i.e. use the Heap policy.
+ */
+class EpochManager {
+public:
+  static constexpr size_t RECLAIM_THRESHOLD = 64;
+
+  /**
+   * \class Guard
+   * \brief Keeps the calling thread pinned while it lives.
+   */
+  class Guard {
+  public:
+    explicit Guard(const EpochManager &epoch) : epoch_(&epoch) {
+      epoch_->enter();
+    }
+    Guard(Guard &&other) noexcept
+        : epoch_(std::exchange(other.epoch_, nullptr)) {}
+    Guard(const Guard &) = delete;
+    Guard &operator=(const Guard &) = delete;
+    ~Guard() {
+      if (epoch_) {
+        epoch_->exit();
+      }
+    }
+
+  private:
+    const EpochManager *epoch_;
+  };
+
+  /**
+   * \brief Create a manager.
+   * \param alloc The allocator retired blocks go back to.
+   */
+  explicit EpochManager(NodeAllocator &alloc) : alloc_(alloc) {
+    assert(alloc.policy() == AllocPolicy::Heap &&
+           "retired blocks are freed from any thread");
+    Registry &registry = live();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    id_ = registry.next_id++;
+    registry.ids.insert(id_);
+  }
+
+  EpochManager(const EpochManager &) = delete;
+  EpochManager &operator=(const EpochManager &) = delete;
+
+  /**
+   * \brief Free everything still retired. No thread may be pinned.
+   */
+  ~EpochManager() {
+    {
+      // threads drop their cache entry lazily, see record()
+      Registry &registry = live();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      registry.ids.erase(id_);
+    }
+    for (auto &record : records_) {
+      assert(record->local.load() == 0 && "a thread is still pinned");
+      for (auto &entry : record->retired) {
+        free(entry);
+      }
+    }
+    for (auto &entry : orphans_) {
+      free(entry);
+    }
+  }
+
+  /**
+   * \brief Pin the calling thread until the guard is destroyed. Nodes
+   * read meanwhile stay allocated. Guards may nest.
+   */
+  Guard pin() const { return Guard(*this); }
+
+  /**
+   * \brief Pin the calling thread, nests.
+   */
+  void enter() const {
+    Record &r = record();
+    if (r.nesting++ == 0) {
+      r.local.store(global_.load(std::memory_order_seq_cst) << 1 | 1,
+                    std::memory_order_seq_cst);
+      // the announcement is visible before any node is read
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+  }
+
+  /**
+   * \brief Unpin the calling thread, once every enter() was matched.
+   */
+  void exit() const {
+    Record &r = record();
+    assert(r.nesting > 0);
+    if (--r.nesting == 0) {
+      r.local.store(0, std::memory_order_release);
+    }
+  }
+
+  /**
+   * \brief Free a node or leaf once no pinned thread can reach it.
+   * \param n A node or tagged leaf, already unlinked from the tree.
+   */
+  void retire(Node *n) { retire(n, nullptr); }
+
+  /**
+   * \brief Free any object once no pinned thread can reach it.
+   * \param p The object, already unreachable for operations that start now.
+   * \param free_fn Frees p, nullptr if p is a node or tagged leaf.
+   */
+  void retire(void *p, void (*free_fn)(void *)) {
+    Record &r = record();
+    r.retired.push_back({global_.load(std::memory_order_seq_cst), p, free_fn});
+    if (r.retired.size() >= r.threshold) {
+      reclaim();
+      // do not rescan a list held up by a slow reader on every retire
+      r.threshold = r.retired.size() + RECLAIM_THRESHOLD;
+    }
+  }
+
+  /**
+   * \brief Try to move the global epoch on, then free what the calling
+   * thread, or a thread that exited, retired and no pinned thread can hold
+   * any more.
+   */
+  void reclaim() {
+    advance();
+    Record &r = record();
+    uint64_t global = global_.load(std::memory_order_acquire);
+    std::vector<Retired> orphans;
+    {
+      std::lock_guard<std::mutex> lock(records_mutex_);
+      size_t kept = 0;
+      for (auto &entry : orphans_) {
+        if (entry.epoch + 3 <= global) {
+          orphans.push_back(entry);
+        } else {
+          orphans_[kept++] = entry;
+        }
+      }
+      orphans_.resize(kept);
+    }
+    for (auto &entry : orphans) {
+      free(entry);
+    }
+    size_t kept = 0;
+    for (auto &entry : r.retired) {
+      if (entry.epoch + 3 <= global) {
+        free(entry);
+      } else {
+        r.retired[kept++] = entry;
+      }
+    }
+    r.retired.resize(kept);
+    r.threshold = RECLAIM_THRESHOLD;
+  }
+
+  /**
+   * \brief The number of blocks the calling thread retired that are not
+   * freed yet.
+   */
+  size_t pending() const { return record().retired.size(); }
+
+  uint64_t epoch() const { return global_.load(std::memory_order_relaxed); }
+
+private:
+  struct Retired {
+    uint64_t epoch;
+    void *p;
+    void (*free_fn)(void *);
+  };
+
+  /**
+   * \struct Record
+   * \brief The state of one thread.
+   */
+  struct Record {
+    // the announced epoch << 1 | 1 while pinned, 0 otherwise
+    alignas(64) std::atomic<uint64_t> local{0};
+    // only touched by the owning thread
+    size_t nesting{0};
+    size_t threshold{RECLAIM_THRESHOLD};
+    std::vector<Retired> retired;
+  };
+
+  void free(const Retired &entry) {
+    if (entry.free_fn) {
+      entry.free_fn(entry.p);
+    } else {
+      Node::free_node(static_cast<Node *>(entry.p), alloc_);
+    }
+  }
+
+  /**
+   * \brief Move the global epoch on if every pinned thread announced it.
+   */
+  void advance() {
+    uint64_t global = global_.load(std::memory_order_seq_cst);
+    {
+      std::lock_guard<std::mutex> lock(records_mutex_);
+      for (auto &record : records_) {
+        uint64_t local = record->local.load(std::memory_order_seq_cst);
+        if ((local & 1) && (local >> 1) != global) {
+          return;
+        }
+      }
+    }
+    global_.compare_exchange_strong(global, global + 1,
+                                    std::memory_order_seq_cst);
+  }
+
+  /**
+   * \brief The calling thread's record, registered on first use.
+   */
+  Record &record() const {
+    std::vector<CacheEntry> &entries = cache().entries;
+    for (auto &entry : entries) {
+      if (entry.id == id_) {
+        return *entry.record;
+      }
+    }
+    {
+      // first use by this thread: drop the entries of destroyed managers,
+      // so the scan above is only as long as the managers still alive
+      Registry &registry = live();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                   [&](const CacheEntry &entry) {
+                                     return !registry.ids.count(entry.id);
+                                   }),
+                    entries.end());
+    }
+    std::lock_guard<std::mutex> lock(records_mutex_);
+    records_.push_back(std::make_unique<Record>());
+    entries.push_back({id_, const_cast<EpochManager *>(this),
+                       records_.back().get()});
+    return *records_.back();
+  }
+
+  /**
+   * \brief Hand a record over when its thread exits: what it retired goes
+   * to orphans_, the record itself is dropped.
+   */
+  void orphan(Record *r) {
+    assert(r->nesting == 0 && "a thread exits pinned");
+    std::lock_guard<std::mutex> lock(records_mutex_);
+    orphans_.insert(orphans_.end(), r->retired.begin(), r->retired.end());
+    records_.erase(std::find_if(records_.begin(), records_.end(),
+                                [&](const auto &p) { return p.get() == r; }));
+  }
+
+  /**
+   * \struct CacheEntry
+   * \brief The record of the calling thread in one manager. Managers are
+   * told apart by id, an address may be reused.
+   */
+  struct CacheEntry {
+    uint64_t id;
+    EpochManager *manager;
+    Record *record;
+  };
+
+  /**
+   * \struct ThreadCache
+   * \brief The calling thread's records; hands them back to the managers
+   * still alive when the thread exits.
+   */
+  struct ThreadCache {
+    std::vector<CacheEntry> entries;
+
+    ~ThreadCache() {
+      // held throughout, so no manager can be destroyed meanwhile
+      Registry &registry = live();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      for (auto &entry : entries) {
+        if (registry.ids.count(entry.id)) {
+          entry.manager->orphan(entry.record);
+        }
+      }
+    }
+  };
+
+  static ThreadCache &cache() {
+    static thread_local ThreadCache cache;
+    return cache;
+  }
+
+  /**
+   * \struct Registry
+   * \brief The ids of the managers alive, for pruning the caches and
+   * handing records back at thread exit.
+   */
+  struct Registry {
+    std::mutex mutex;
+    uint64_t next_id{0};
+    std::unordered_set<uint64_t> ids;
+  };
+
+  static Registry &live() {
+    static Registry registry;
+    return registry;
+  }
+
+  NodeAllocator &alloc_;
+  uint64_t id_;
+  std::atomic<uint64_t> global_{0};
+  mutable std::mutex records_mutex_;
+  mutable std::vector<std::unique_ptr<Record>> records_;
+  // retired by threads that exited, guarded by records_mutex_
+  std::vector<Retired> orphans_;
+};
+
+} // namespace arttree
@@ -0,0 +1,598 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "art_rowex.hpp"
+
+namespace arttree {
+
+/**
+ * \class MvccArtTree
+ * \brief A multi-version key-value index: every write adds a version
+ * stamped with a commit timestamp, and a reader sees the tree as of the
+ * timestamp it started at, without ever waiting for a writer.
+ *
+ * The keys live in a RowexArtTree, so lookups are wait-free. The leaf of a
+ * key holds a pointer to its version chain, newest first; a write links a
+ * new version into the chain with one compare-and-swap, an erase links a
+ * tombstone. Timestamps come from one clock and commit in order: a writer
+ * publishes its version, then waits for the writers with smaller
+ * timestamps before moving the commit timestamp past its own, so a reader
+ * at timestamp t sees exactly the writes up to t.
+ *
+ * So a writer preempted between taking its timestamp and committing holds
+ * up the commit of every later writer, which spin until it is done (readers
+ * are never held up). The version is allocated before the timestamp is
+ * taken, and a writer that throws in between still commits its timestamp,
+ * with nothing written, before the exception leaves write().
+ *
+ * A reader announces its timestamp in one of READER_SLOTS slots with a
+ * compare-and-swap, no lock is taken and nothing allocated; only readers
+ * beyond that many fall back to a locked list.
+ *
+ * gc() trims the versions no active reader can see any more and removes
+ * keys whose newest visible version is an old tombstone; it runs in the
+ * background when the tree is created with an interval. Only chains that
+ * were written since are looked at. Trimmed versions and chains are
+ * retired to the index's EpochManager, which every call pins while it
+ * runs; a read transaction does not stay pinned between its calls.
+ */
+class MvccArtTree {
+public:
+  // concurrent readers announced without a lock
+  static constexpr size_t READER_SLOTS = 64;
+
+private:
+  static constexpr uint64_t FREE = UINT64_MAX;
+
+  /**
+   * \struct Slot
+   * \brief The timestamp of one active reader, FREE if none.
+   */
+  struct Slot {
+    // own cache line, readers do not contend on announcing
+    alignas(64) std::atomic<uint64_t> ts{FREE};
+  };
+
+  /**
+   * \struct Reader
+   * \brief Where a reader announced itself: a slot, or overflow_ if every
+   * slot was taken.
+   */
+  struct Reader {
+    std::atomic<uint64_t> *slot{nullptr};
+    std::multiset<uint64_t>::iterator overflow;
+  };
+
+public:
+  /**
+   * \class ReadTxn
+   * \brief A read-only view at one timestamp. Versions it can see are kept
+   * until it is destroyed, which holds back gc() but not the reclamation
+   * of index nodes: the epoch is only pinned within each call.
+   */
+  class ReadTxn {
+  public:
+    ReadTxn(ReadTxn &&other) noexcept
+        : tree_(std::exchange(other.tree_, nullptr)), ts_(other.ts_),
+          reader_(other.reader_) {}
+    ReadTxn(const ReadTxn &) = delete;
+    ReadTxn &operator=(const ReadTxn &) = delete;
+
+    ~ReadTxn() {
+      if (tree_) {
+        tree_->leave(reader_);
+      }
+    }
+
+    uint64_t timestamp() const { return ts_; }
+
+    /**
+     * \brief Search for a key as of the view's timestamp.
+     * \param key The key to search for.
+     * \param val The value, readable while the view lives.
+     * \return True if the key existed at that timestamp, false otherwise.
+     */
+    bool search(std::string_view key, std::string_view &val) const {
+      // the version stays while the view lives, see gc(), the index nodes
+      // on the way only while pinned
+      auto guard = tree_->index_.pin();
+      const Version *v = tree_->visible(key, ts_);
+      if (v == nullptr) {
+        return false;
+      }
+      val = v->load_val();
+      return true;
+    }
+
+  private:
+    friend class MvccArtTree;
+
+    ReadTxn(const MvccArtTree *tree, uint64_t ts, Reader reader)
+        : tree_(tree), ts_(ts), reader_(reader) {}
+
+    const MvccArtTree *tree_;
+    uint64_t ts_;
+    Reader reader_;
+  };
+
+  /**
+   * \brief Create an empty tree.
+   * \param gc_interval How often the background collector runs, zero for
+   * no background thread (call gc() instead).
+   */
+  explicit MvccArtTree(
+      std::chrono::milliseconds gc_interval = std::chrono::milliseconds{0}) {
+    if (gc_interval.count() > 0) {
+      gc_thread_ = std::thread([this, gc_interval] {
+        std::unique_lock<std::mutex> lock(gc_mutex_);
+        while (!gc_cv_.wait_for(lock, gc_interval, [this] { return stop_; })) {
+          lock.unlock();
+          gc();
+          lock.lock();
+        }
+      });
+    }
+  }
+
+  MvccArtTree(const MvccArtTree &) = delete;
+  MvccArtTree &operator=(const MvccArtTree &) = delete;
+
+  /**
+   * \brief Stop the collector and free every chain. No reader may be
+   * active.
+   */
+  ~MvccArtTree() {
+    if (gc_thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(gc_mutex_);
+        stop_ = true;
+      }
+      gc_cv_.notify_all();
+      gc_thread_.join();
+    }
+    assert(std::all_of(std::begin(slots_), std::end(slots_),
+                       [](const Slot &s) { return s.ts.load() == FREE; }) &&
+           overflow_.empty() && "a reader outlives the tree");
+    free_chains(index_.root_);
+  }
+
+  /**
+   * \brief Write a new version of a key.
+   * \param key The key.
+   * \param val The value.
+   * \return The commit timestamp of the version, 0 if key is not a
+   * valid_key and nothing was written.
+   */
+  uint64_t put(std::string_view key, std::string_view val) {
+    return write(key, val, false);
+  }
+
+  /**
+   * \brief Write a tombstone for a key; readers from the returned
+   * timestamp on do not see it.
+   * \param key The key.
+   * \return The commit timestamp of the tombstone, 0 if key is not a
+   * valid_key and nothing was written.
+   */
+  uint64_t erase(std::string_view key) { return write(key, {}, true); }
+
+  /**
+   * \brief Start a view at the latest commit timestamp.
+   */
+  ReadTxn read() const {
+    while (true) {
+      uint64_t ts = commit_.load(std::memory_order_acquire);
+      Reader reader;
+      // fails only if a gc() moved past ts meanwhile, commit_ did as well
+      if (enter(ts, reader)) {
+        return ReadTxn(this, ts, reader);
+      }
+    }
+  }
+
+  /**
+   * \brief Start a view at an earlier timestamp.
+   * \param ts The timestamp, at most timestamp().
+   * \return The view, or std::nullopt if ts is older than what gc() keeps.
+   */
+  std::optional<ReadTxn> read_at(uint64_t ts) const {
+    Reader reader;
+    if (ts > commit_.load(std::memory_order_acquire) || !enter(ts, reader)) {
+      return std::nullopt;
+    }
+    return ReadTxn(this, ts, reader);
+  }
+
+  /**
+   * \brief Look up the latest committed value of a key.
+   * \param key The key.
+   * \param val Receives a copy of the value.
+   * \return True if the key exists, false otherwise.
+   */
+  bool get(std::string_view key, std::string &val) const {
+    ReadTxn txn = read();
+    std::string_view found;
+    if (!txn.search(key, found)) {
+      return false;
+    }
+    val.assign(found);
+    return true;
+  }
+
+  /**
+   * \brief The latest commit timestamp.
+   */
+  uint64_t timestamp() const {
+    return commit_.load(std::memory_order_acquire);
+  }
+
+  /**
+   * \brief Trim the versions older than the oldest active reader needs,
+   * and remove keys that are erased for every reader.
+   * \return The number of versions freed.
+   */
+  size_t gc();
+
+private:
+  /**
+   * \brief Announce a reader at ts, so gc() keeps what it sees.
+   * \param ts The reader's timestamp.
+   * \param reader Set to where it was announced.
+   * \return False if gc() may have trimmed what ts needs already, nothing
+   * is announced then.
+   */
+  bool enter(uint64_t ts, Reader &reader) const;
+
+  void leave(Reader reader) const {
+    if (reader.slot) {
+      reader.slot->store(FREE, std::memory_order_release);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(overflow_mutex_);
+    overflow_.erase(reader.overflow);
+  }
+
+  /**
+   * \struct Version
+   * \brief One value of a key, followed by the value bytes.
+   */
+  struct Version {
+    uint64_t ts;
+    std::atomic<Version *> next{nullptr};
+    uint32_t len;
+    bool tombstone;
+
+    // the value bytes follow the header
+    char *data() { return reinterpret_cast<char *>(this + 1); }
+    const char *data() const {
+      return reinterpret_cast<const char *>(this + 1);
+    }
+
+    std::string_view load_val() const { return {data(), len}; }
+  };
+
+  /**
+   * \struct Chain
+   * \brief The versions of one key, newest first.
+   */
+  struct Chain {
+    std::atomic<Version *> head{nullptr};
+    // set while the chain waits in gc_queue_
+    std::atomic<bool> queued{false};
+    std::string key;
+  };
+
+  /**
+   * \brief The head of a chain gc() removed from the index; a writer that
+   * finds it waits for the key to go and starts a new chain.
+   */
+  static Version *dead() {
+    static Version sentinel{};
+    return &sentinel;
+  }
+
+  static Version *make_version(uint64_t ts, std::string_view val,
+                               bool tombstone) {
+    void *mem = ::operator new(sizeof(Version) + val.size());
+    auto *v = new (mem) Version{};
+    v->ts = ts;
+    v->len = static_cast<uint32_t>(val.size());
+    v->tombstone = tombstone;
+    memcpy(v->data(), val.data(), val.size());
+    return v;
+  }
+
+  static void free_version(void *v) { ::operator delete(v); }
+  static void free_chain(void *c) { delete static_cast<Chain *>(c); }
+
+  /**
+   * \brief Find the chain of a key in the index.
+   */
+  Chain *find_chain(std::string_view key) const {
+    std::string_view raw;
+    if (!index_.search(key, raw)) {
+      return nullptr;
+    }
+    Chain *chain;
+    memcpy(&chain, raw.data(), sizeof(chain));
+    return chain;
+  }
+
+  /**
+   * \brief The version of a key a reader at ts sees.
+   * \return The version, or nullptr if the key did not exist at ts.
+   */
+  const Version *visible(std::string_view key, uint64_t ts) const {
+    Chain *chain = find_chain(key);
+    if (chain == nullptr) {
+      return nullptr;
+    }
+    Version *v = chain->head.load(std::memory_order_acquire);
+    if (v == dead()) {
+      return nullptr;
+    }
+    while (v && v->ts > ts) {
+      v = v->next.load(std::memory_order_acquire);
+    }
+    return v && !v->tombstone ? v : nullptr;
+  }
+
+  uint64_t write(std::string_view key, std::string_view val, bool tombstone);
+
+  /**
+   * \brief Link ver into the chain of key, creating the chain if the key
+   * is new.
+   * \return The chain if it needs a gc() pass, nullptr otherwise. If it
+   * throws, ver is not linked.
+   */
+  Chain *link(std::string_view key, Version *ver);
+
+  /**
+   * \brief Move the commit timestamp to ts once every smaller timestamp
+   * is committed.
+   */
+  void commit(uint64_t ts) noexcept {
+    while (commit_.load(std::memory_order_acquire) != ts - 1) {
+      std::this_thread::yield();
+    }
+    commit_.store(ts, std::memory_order_release);
+  }
+
+  void enqueue(Chain *chain) noexcept {
+    if (!chain->queued.exchange(true)) {
+      try {
+        std::lock_guard<std::mutex> lock(gc_queue_mutex_);
+        gc_queue_.push_back(chain);
+      } catch (...) {
+        // out of memory: the next write of the chain queues it
+        chain->queued.store(false);
+      }
+    }
+  }
+
+  /**
+   * \brief Free the chains of every leaf below n, at destruction.
+   */
+  void free_chains(Node *n) {
+    if (Node::is_leaf(n)) {
+      Chain *chain;
+      memcpy(&chain, Node::to_leaf(n)->load_val().data(), sizeof(chain));
+      for (Version *v = chain->head.load(); v != nullptr;) {
+        Version *next = v->next.load();
+        free_version(v);
+        v = next;
+      }
+      delete chain;
+      return;
+    }
+    n->for_each_child(
+        [this](Node *child, unsigned char) { free_chains(child); });
+  }
+
+  // declared first, the chains it retires are freed when it goes
+  RowexArtTree index_;
+  // the next timestamp handed out is clock_ + 1
+  std::atomic<uint64_t> clock_{0};
+  // every timestamp up to commit_ is published
+  std::atomic<uint64_t> commit_{0};
+
+  // the timestamps of the active readers, the rare ones beyond
+  // READER_SLOTS in overflow_
+  mutable Slot slots_[READER_SLOTS];
+  mutable std::mutex overflow_mutex_;
+  mutable std::multiset<uint64_t> overflow_;
+  // versions older than this may be trimmed already, never decreases
+  std::atomic<uint64_t> horizon_{0};
+  // odd while a gc() collects the readers' timestamps, see enter()
+  std::atomic<uint64_t> gc_seq_{0};
+  // one gc() at a time
+  std::mutex gc_run_mutex_;
+
+  std::mutex gc_queue_mutex_;
+  std::vector<Chain *> gc_queue_;
+
+  std::thread gc_thread_;
+  std::mutex gc_mutex_;
+  std::condition_variable gc_cv_;
+  bool stop_{false};
+};
+
+inline uint64_t MvccArtTree::write(std::string_view key, std::string_view val,
+                                   bool tombstone) {
+  if (!valid_key(key)) {
+    // timestamps start at 1
+    return 0;
+  }
+  auto guard = index_.pin();
+  Version *ver = make_version(0, val, tombstone);
+  // every later writer waits for this one to commit from here on
+  uint64_t ts = clock_.fetch_add(1, std::memory_order_relaxed) + 1;
+  ver->ts = ts;
+
+  Chain *chain = nullptr;
+  try {
+    chain = link(key, ver);
+  } catch (...) {
+    // the version was not linked; commit nothing at ts
+    free_version(ver);
+    commit(ts);
+    throw;
+  }
+  if (chain) {
+    enqueue(chain);
+  }
+  commit(ts);
+  return ts;
+}
+
+inline MvccArtTree::Chain *MvccArtTree::link(std::string_view key,
+                                             Version *ver) {
+  Chain *chain;
+  while (true) {
+    chain = find_chain(key);
+    if (chain == nullptr) {
+      if (ver->tombstone) {
+        // nothing to hide
+        free_version(ver);
+        return nullptr;
+      }
+      chain = new Chain;
+      try {
+        chain->key.assign(key);
+        chain->head.store(ver, std::memory_order_relaxed);
+        char raw[sizeof(chain)];
+        memcpy(raw, &chain, sizeof(chain));
+        if (index_.insert_if_absent(key, {raw, sizeof(raw)})) {
+          return nullptr;
+        }
+      } catch (...) {
+        delete chain;
+        throw;
+      }
+      delete chain;
+      continue;
+    }
+    // keep the chain sorted: a writer with a larger timestamp may have
+    // linked its version first
+    std::atomic<Version *> *at = &chain->head;
+    Version *cur = at->load(std::memory_order_acquire);
+    if (cur == dead()) {
+      std::this_thread::yield();
+      continue;
+    }
+    while (cur && cur->ts > ver->ts) {
+      at = &cur->next;
+      cur = at->load(std::memory_order_acquire);
+    }
+    ver->next.store(cur, std::memory_order_relaxed);
+    if (at->compare_exchange_strong(cur, ver, std::memory_order_acq_rel)) {
+      return chain;
+    }
+  }
+}
+
+inline bool MvccArtTree::enter(uint64_t ts, Reader &reader) const {
+  reader = Reader{};
+  size_t start = std::hash<std::thread::id>{}(std::this_thread::get_id());
+  for (size_t i = 0; i < READER_SLOTS && !reader.slot; ++i) {
+    std::atomic<uint64_t> &slot = slots_[(start + i) % READER_SLOTS].ts;
+    uint64_t expected = FREE;
+    if (slot.load(std::memory_order_relaxed) == FREE &&
+        slot.compare_exchange_strong(expected, ts, std::memory_order_seq_cst)) {
+      reader.slot = &slot;
+    }
+  }
+  if (!reader.slot) {
+    std::lock_guard<std::mutex> lock(overflow_mutex_);
+    reader.overflow = overflow_.insert(ts);
+  }
+  // A gc() that starts collecting after this point sees the reader. One
+  // that is collecting now may not have: wait for its horizon, which is
+  // at most ts if it saw the reader.
+  while (gc_seq_.load(std::memory_order_seq_cst) & 1) {
+    std::this_thread::yield();
+  }
+  if (ts >= horizon_.load(std::memory_order_seq_cst)) {
+    return true;
+  }
+  leave(reader);
+  return false;
+}
+
+inline size_t MvccArtTree::gc() {
+  std::lock_guard<std::mutex> run(gc_run_mutex_);
+  auto guard = index_.pin();
+  gc_seq_.fetch_add(1, std::memory_order_seq_cst);
+  uint64_t oldest = commit_.load(std::memory_order_acquire);
+  for (const Slot &slot : slots_) {
+    oldest = std::min(oldest, slot.ts.load(std::memory_order_seq_cst));
+  }
+  {
+    std::lock_guard<std::mutex> lock(overflow_mutex_);
+    if (!overflow_.empty()) {
+      oldest = std::min(oldest, *overflow_.begin());
+    }
+  }
+  // a reader below the horizon is about to be refused, do not go back
+  oldest = std::max(oldest, horizon_.load(std::memory_order_relaxed));
+  horizon_.store(oldest, std::memory_order_seq_cst);
+  gc_seq_.fetch_add(1, std::memory_order_seq_cst);
+  std::vector<Chain *> queue;
+  {
+    std::lock_guard<std::mutex> lock(gc_queue_mutex_);
+    queue.swap(gc_queue_);
+  }
+
+  size_t freed = 0;
+  for (Chain *chain : queue) {
+    // a write from now on queues the chain again
+    chain->queued.store(false);
+    Version *head = chain->head.load(std::memory_order_acquire);
+    Version *keep = head;
+    while (keep && keep->ts > oldest) {
+      keep = keep->next.load(std::memory_order_acquire);
+    }
+    if (keep == nullptr) {
+      // every version is newer than the oldest reader
+      enqueue(chain);
+      continue;
+    }
+    // keep is what the oldest reader sees, no reader goes past it
+    Version *tail = keep->next.exchange(nullptr, std::memory_order_acq_rel);
+    for (; tail != nullptr; freed++) {
+      Version *next = tail->next.load(std::memory_order_relaxed);
+      index_.epoch_.retire(tail, free_version);
+      tail = next;
+    }
+    Version *expected = keep;
+    if (keep == head && keep->tombstone &&
+        chain->head.compare_exchange_strong(expected, dead())) {
+      // erased for every reader, and no writer got in since
+      index_.erase(chain->key);
+      index_.epoch_.retire(keep, free_version);
+      index_.epoch_.retire(chain, free_chain);
+      freed++;
+    } else if (keep != chain->head.load(std::memory_order_acquire) ||
+               keep->tombstone) {
+      // newer versions or a tombstone are left for a later pass
+      enqueue(chain);
+    }
+  }
+  return freed;
+}
+
+} // namespace arttree
@@ -0,0 +1,250 @@
+#pragma once
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+
+#include "art.hpp"
+
+namespace arttree {
+
+/**
+ * \brief How ShardedArtTree spreads keys over its shards.
+ */
+enum class ShardMode {
+  // shards hold consecutive key ranges, routed by the leading bytes
+  Range,
+  // shards hold hashed keys, even under skewed prefixes
+  Hash,
+};
+
+/**
+ * \class ShardedArtTree
+ * \brief N independent ARTs behind one interface, each with its own
+ * reader-writer lock and allocator, so writers to different shards run in
+ * parallel.
+ *
+ * A key goes to the shard its router picks. In Range mode the router must
+ * not decrease in key order, the default splits the first byte evenly, so
+ * an ordered scan walks the shards one after another. In Hash mode the
+ * default hashes the whole key and an ordered scan merges the shards.
+ *
+ * An operation locks one shard, a scan every shard it reads (shared, in
+ * shard order). Values are copied out, since a writer may change a value
+ * in place once the lock is released.
+ */
+template <size_t N> class ShardedArtTree {
+  static_assert(N > 0, "at least one shard");
+
+public:
+  /**
+   * \brief Picks the shard of a key, returns a value less than N.
+   */
+  using Router = std::function<size_t(std::string_view)>;
+
+  /**
+   * \brief Create the shards with the default router of a mode.
+   * \param mode Range or hash partitioning.
+   * \param policy The allocation policy of every shard.
+   */
+  explicit ShardedArtTree(ShardMode mode = ShardMode::Range,
+                          AllocPolicy policy = AllocPolicy::Slab)
+      : ShardedArtTree(mode, default_router(mode), policy) {}
+
+  /**
+   * \brief Create the shards with a custom router.
+   * \param mode Range if router does not decrease in key order, Hash
+   * otherwise.
+   * \param router Picks the shard of a key.
+   * \param policy The allocation policy of every shard.
+   */
+  ShardedArtTree(ShardMode mode, Router router,
+                 AllocPolicy policy = AllocPolicy::Slab)
+      : mode_(mode), router_(std::move(router)) {
+    for (auto &shard : shards_) {
+      shard = std::make_unique<Shard>(policy);
+    }
+  }
+
+  ShardedArtTree(const ShardedArtTree &) = delete;
+  ShardedArtTree &operator=(const ShardedArtTree &) = delete;
+
+  ShardMode mode() const { return mode_; }
+
+  /**
+   * \brief The shard index of a key.
+   */
+  size_t shard_of(std::string_view key) const {
+    size_t i = router_(key);
+    assert(i < N && "router out of range");
+    return i;
+  }
+
+  /**
+   * \brief Insert a key-value pair, or overwrite the value of an existing
+   * key.
+   * \return True if the key was created, false if it was assigned or is
+   * not a valid_key, which stores nothing.
+   */
+  bool insert_or_assign(std::string_view key, std::string_view val) {
+    Shard &shard = *shards_[shard_of(key)];
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    return shard.tree.insert_or_assign(key, val);
+  }
+
+  /**
+   * \brief Insert a key-value pair if the key is not present yet.
+   * \return True if the key was created, false if it already existed or
+   * is not a valid_key, which stores nothing.
+   */
+  bool insert_if_absent(std::string_view key, std::string_view val) {
+    Shard &shard = *shards_[shard_of(key)];
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    return shard.tree.insert_if_absent(key, val);
+  }
+
+  /**
+   * \brief Set the value of a key from its current value, see
+   * ArtTree::update. fn runs under the shard's lock.
+   * \return True if the key was created, false if it was updated or is
+   * not a valid_key, which stores nothing (fn is not called).
+   */
+  template <typename Fn> bool update(std::string_view key, Fn &&fn) {
+    Shard &shard = *shards_[shard_of(key)];
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    return shard.tree.update(key, std::forward<Fn>(fn));
+  }
+
+  /**
+   * \brief Search for a key.
+   * \param key The key to search for.
+   * \param val Receives a copy of the value.
+   * \return True if the key was found, false otherwise.
+   */
+  bool search(std::string_view key, std::string &val) const {
+    const Shard &shard = *shards_[shard_of(key)];
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    std::string_view found;
+    if (!shard.tree.search(key, found)) {
+      return false;
+    }
+    val.assign(found);
+    return true;
+  }
+
+  /**
+   * \brief Remove a key.
+   * \return True if the key was found and removed, false otherwise.
+   */
+  bool erase(std::string_view key) {
+    Shard &shard = *shards_[shard_of(key)];
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    return shard.tree.erase(key);
+  }
+
+  /**
+   * \brief The number of keys in all shards. Shards are counted one at a
+   * time, so concurrent writes may or may not be included.
+   */
+  size_t size() const {
+    size_t n = 0;
+    for (auto &shard : shards_) {
+      std::shared_lock<std::shared_mutex> lock(shard->mutex);
+      n += shard->tree.size();
+    }
+    return n;
+  }
+
+  /**
+   * \brief Visit the keys not less than from in lexicographic order across
+   * all shards. The shards read are locked shared for the whole scan, so
+   * fn must not write to the tree.
+   * \param from The first key to visit, empty visits every key.
+   * \param fn Called with each key and value; returns false to stop.
+   * \return True if every key was visited, false if fn stopped the scan.
+   */
+  template <typename Fn> bool scan(std::string_view from, Fn &&fn) const;
+
+  /**
+   * \brief Run fn on one shard's tree under its exclusive lock, e.g. for
+   * a bulk load.
+   */
+  template <typename Fn> decltype(auto) with_shard(size_t i, Fn &&fn) {
+    std::unique_lock<std::shared_mutex> lock(shards_[i]->mutex);
+    return std::forward<Fn>(fn)(shards_[i]->tree);
+  }
+
+private:
+  struct Shard {
+    explicit Shard(AllocPolicy policy) : tree(policy) {}
+
+    // own cache line, so shards do not contend on the lock word
+    alignas(64) mutable std::shared_mutex mutex;
+    ArtTree tree;
+  };
+
+  static Router default_router(ShardMode mode) {
+    if (mode == ShardMode::Hash) {
+      return [](std::string_view key) {
+        return std::hash<std::string_view>{}(key) % N;
+      };
+    }
+    // the empty key sorts first and goes with byte 0
+    return [](std::string_view key) {
+      return key.empty() ? 0 : static_cast<unsigned char>(key[0]) * N / 256;
+    };
+  }
+
+  ShardMode mode_;
+  Router router_;
+  std::array<std::unique_ptr<Shard>, N> shards_;
+};
+
+template <size_t N>
+template <typename Fn>
+bool ShardedArtTree<N>::scan(std::string_view from, Fn &&fn) const {
+  if (mode_ == ShardMode::Range) {
+    // every key of shard i sorts before every key of shard i + 1
+    for (size_t i = shard_of(from); i < N; ++i) {
+      std::shared_lock<std::shared_mutex> lock(shards_[i]->mutex);
+      const ArtTree &tree = shards_[i]->tree;
+      for (auto it = tree.lower_bound(from); it != tree.end(); ++it) {
+        if (!fn(it.key(), it.value())) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // hash mode: merge the shards, all locked for the whole scan
+  std::array<std::shared_lock<std::shared_mutex>, N> locks;
+  std::array<ArtTree::iterator, N> its;
+  for (size_t i = 0; i < N; ++i) {
+    locks[i] = std::shared_lock<std::shared_mutex>(shards_[i]->mutex);
+    its[i] = shards_[i]->tree.lower_bound(from);
+  }
+  while (true) {
+    // N is small, a linear pick beats keeping a heap
+    size_t min = N;
+    for (size_t i = 0; i < N; ++i) {
+      if (its[i] != shards_[i]->tree.end() &&
+          (min == N || its[i].key() < its[min].key())) {
+        min = i;
+      }
+    }
+    if (min == N) {
+      return true;
+    }
+    if (!fn(its[min].key(), its[min].value())) {
+      return false;
+    }
+    ++its[min];
+  }
+}
+
+} // namespace arttree
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace arttree {
+
+/**
+ * \class ThreadPool
+ * \brief A fixed set of worker threads with work stealing.
+ *
+ * Every worker owns a task deque. A task submitted from a worker goes to
+ * that worker's deque, others are spread round-robin. A worker runs its own
+ * newest task first and, when its deque is empty, steals the oldest task of
+ * another worker. wait() lets the calling thread run tasks as well.
+ *
+ * A task that throws does not take its worker down: the first exception
+ * of a group is kept and rethrown by the wait() on that group.
+ */
+class ThreadPool {
+public:
+  /**
+   * \class Group
+   * \brief The tasks of one caller, so it can wait for its own tasks on a
+   * shared pool rather than for every task.
+   */
+  class Group {
+  public:
+    Group() = default;
+    Group(const Group &) = delete;
+    Group &operator=(const Group &) = delete;
+
+  private:
+    friend class ThreadPool;
+
+    // submitted and not finished yet
+    std::atomic<size_t> pending{0};
+    // the first exception a task threw, guarded by the pool's mutex_
+    std::exception_ptr error;
+  };
+
+  /**
+   * \brief Start the workers.
+   * \param threads The number of workers, 0 picks one per hardware thread.
+   */
+  explicit ThreadPool(size_t threads = 0) {
+    if (threads == 0) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    queues_.reserve(threads);
+    for (size_t i = 0; i < threads; ++i) {
+      queues_.push_back(std::make_unique<Queue>());
+    }
+    workers_.reserve(threads);
+    for (size_t i = 0; i < threads; ++i) {
+      workers_.emplace_back([this, i] { work(i); });
+    }
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /**
+   * \brief Finish the queued tasks and join the workers.
+   */
+  ~ThreadPool() {
+    // nobody is left to rethrow to
+    drain(nullptr);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  size_t size() const { return workers_.size(); }
+
+  /**
+   * \brief Queue a task.
+   * \param task The task, may itself submit tasks.
+   */
+  void submit(std::function<void()> task) {
+    submit(ungrouped_, std::move(task));
+  }
+
+  /**
+   * \brief Queue a task of a group.
+   * \param group The group, must live until wait(group) returned.
+   * \param task The task, may itself submit tasks.
+   */
+  void submit(Group &group, std::function<void()> task) {
+    size_t i = current_pool() == this ? current_index()
+                                      : next_.fetch_add(1) % queues_.size();
+    group.pending.fetch_add(1);
+    pending_.fetch_add(1);
+    {
+      // counted before it can be taken, so queued_ never drops below 0;
+      // pairs with the check in work(), so a worker about to sleep sees it
+      std::lock_guard<std::mutex> lock(mutex_);
+      queued_++;
+    }
+    {
+      std::lock_guard<std::mutex> lock(queues_[i]->mutex);
+      queues_[i]->tasks.push_back({std::move(task), &group});
+    }
+    wake_.notify_one();
+  }
+
+  /**
+   * \brief Run queued tasks on the calling thread until every task
+   * submitted so far finished, then rethrow the first exception of a task
+   * submitted without a group.
+   */
+  void wait() {
+    drain(nullptr);
+    rethrow(ungrouped_);
+  }
+
+  /**
+   * \brief Run queued tasks on the calling thread until every task of
+   * group finished, then rethrow the first exception one of them threw.
+   */
+  void wait(Group &group) {
+    drain(&group);
+    rethrow(group);
+  }
+
+private:
+  struct Task {
+    std::function<void()> fn;
+    Group *group;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  /**
+   * \brief Run tasks until those of group, or all of them for nullptr,
+   * finished.
+   */
+  void drain(Group *group) {
+    const std::atomic<size_t> &pending = group ? group->pending : pending_;
+    while (pending.load() != 0) {
+      if (!run_one(queues_.size())) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [&] { return pending.load() == 0 || queued_ > 0; });
+      }
+    }
+  }
+
+  void rethrow(Group &group) {
+    std::exception_ptr error;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      error = std::exchange(group.error, nullptr);
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  static ThreadPool *&current_pool() {
+    static thread_local ThreadPool *pool = nullptr;
+    return pool;
+  }
+
+  static size_t &current_index() {
+    static thread_local size_t index = 0;
+    return index;
+  }
+
+  /**
+   * \brief Take a task, the newest of queue self first, else the oldest of
+   * another queue, and run it.
+   * \param self The caller's queue, queues_.size() for a non-worker.
+   * \return True if a task ran.
+   */
+  bool run_one(size_t self) {
+    Task task{};
+    if (self < queues_.size()) {
+      std::lock_guard<std::mutex> lock(queues_[self]->mutex);
+      if (!queues_[self]->tasks.empty()) {
+        task = std::move(queues_[self]->tasks.back());
+        queues_[self]->tasks.pop_back();
+      }
+    }
+    for (size_t k = 1; !task.fn && k <= queues_.size(); ++k) {
+      Queue &victim = *queues_[(self + k) % queues_.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+      }
+    }
+    if (!task.fn) {
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queued_--;
+    }
+    try {
+      task.fn();
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!task.group->error) {
+        task.group->error = std::current_exception();
+      }
+    }
+    // the group may be gone once its count reaches 0, read nothing after
+    bool group_done = task.group->pending.fetch_sub(1) == 1;
+    bool all_done = pending_.fetch_sub(1) == 1;
+    if (group_done || all_done) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_.notify_all();
+    }
+    return true;
+  }
+
+  void work(size_t index) {
+    current_pool() = this;
+    current_index() = index;
+    while (true) {
+      if (run_one(index)) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_.wait(lock, [this] { return stop_ || queued_ > 0; });
+      if (stop_ && queued_ == 0) {
+        return;
+      }
+    }
+  }
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+  std::atomic<size_t> next_{0};
+  // submitted and not finished yet
+  std::atomic<size_t> pending_{0};
+  // the group of the tasks submitted without one
+  Group ungrouped_;
+  // guards queued_ and stop_, the sleep/wake-up condition of the workers
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  size_t queued_{0};
+  bool stop_{false};
+};
+
+} // namespace arttree
@@ -0,0 +1,126 @@
+#include <gtest/gtest.h>
+#include <map>
+#include <random>
+#define private public
+#include "../art_coro.hpp"
+
+using namespace arttree;
+
+static std::vector<std::string> random_keys(size_t n, unsigned seed) {
+  std::mt19937 rng(seed);
+  std::vector<std::string> keys;
+  for (size_t i = 0; i < n; i++) {
+    std::string key;
+    size_t len = 1 + rng() % 20;
+    for (size_t j = 0; j < len; j++) {
+      key.push_back(1 + rng() % (j % 3 ? 4 : 255));
+    }
+    keys.push_back(key);
+  }
+  return keys;
+}
+
+TEST(CoroTest, search_test) {
+  ArtTree tree;
+  auto keys = random_keys(20000, 16);
+  for (size_t i = 0; i < keys.size(); i += 2) {
+    tree.insert(keys[i], std::to_string(i));
+  }
+
+  Scheduler sched(tree);
+  std::vector<std::optional<std::string_view>> out(keys.size());
+  for (size_t batch : {1, 3, 16, 100}) {
+    sched.set_batch_size(batch);
+    ASSERT_EQ(sched.batch_size(), batch);
+    std::fill(out.begin(), out.end(), std::string_view{"stale"});
+    std::vector<std::string_view> probe(keys.begin(), keys.end());
+    sched.multi_search(probe.data(), probe.size(), out.data());
+    for (size_t i = 0; i < keys.size(); i++) {
+      std::string_view expect;
+      if (tree.search(keys[i], expect)) {
+        ASSERT_EQ(out[i], expect);
+      } else {
+        ASSERT_FALSE(out[i].has_value());
+      }
+    }
+  }
+
+  ArtTree empty;
+  Scheduler none(empty);
+  std::optional<std::string_view> res = "stale";
+  none.run(1, [&](size_t) { return none.search("a", res); });
+  ASSERT_FALSE(res.has_value());
+}
+
+TEST(CoroTest, insert_test) {
+  ArtTree tree;
+  auto keys = random_keys(20000, 17);
+  std::map<std::string, std::string> expect;
+  std::vector<std::string> vals;
+  for (size_t i = 0; i < keys.size(); i++) {
+    vals.push_back(std::to_string(i));
+  }
+  std::vector<std::pair<std::string_view, std::string_view>> kvs;
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (expect.emplace(keys[i], vals[i]).second) {
+      kvs.emplace_back(keys[i], vals[i]);
+    }
+  }
+
+  Scheduler sched(tree, 8);
+  sched.multi_insert(kvs.data(), kvs.size());
+  ASSERT_EQ(tree.size(), expect.size());
+  for (auto &[k, v] : expect) {
+    std::string_view val;
+    ASSERT_TRUE(tree.search(k, val));
+    ASSERT_EQ(val, v);
+  }
+}
+
+TEST(CoroTest, mixed_test) {
+  // lookups suspended across inserts restart and still see a valid tree
+  ArtTree tree;
+  auto keys = random_keys(20000, 18);
+  std::vector<std::string> vals;
+  for (size_t i = 0; i < keys.size(); i++) {
+    vals.push_back(std::to_string(i));
+  }
+  for (size_t i = 0; i < keys.size(); i += 4) {
+    tree.insert(keys[i], vals[i]);
+  }
+
+  Scheduler sched(tree, 32);
+  std::vector<std::optional<std::string_view>> out(keys.size());
+  std::vector<ArtTree::iterator> lbs(keys.size());
+  std::vector<char> created(keys.size());
+  sched.run(keys.size(), [&](size_t i) {
+    switch (i % 3) {
+    case 0:
+      return sched.search(keys[i], out[i]);
+    case 1:
+      return sched.insert(keys[i], vals[i], (bool *)&created[i]);
+    default:
+      return sched.lower_bound(keys[i], lbs[i]);
+    }
+  });
+
+  for (size_t i = 1; i < keys.size(); i += 3) {
+    std::string_view val;
+    ASSERT_TRUE(tree.search(keys[i], val));
+  }
+  // every key inserted up front is still found
+  for (size_t i = 0; i < keys.size(); i += 12) {
+    ASSERT_TRUE(out[i].has_value());
+  }
+  // the last lower_bound ran after every insert
+  size_t last = keys.size() - 1;
+  while (last % 3 != 2) {
+    last--;
+  }
+  ASSERT_TRUE(lbs[last] == tree.lower_bound(keys[last]));
+}
+
+int main(int, char **) {
+  ::testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,118 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <thread>
+#define private public
+#include "../epoch.hpp"
+
+using namespace arttree;
+
+TEST(EpochTest, pinned_reader_test) {
+  NodeAllocator alloc(AllocPolicy::Heap);
+  EpochManager epoch(alloc);
+  std::atomic<int> stage{0};
+  std::thread reader([&] {
+    auto guard = epoch.pin();
+    stage = 1;
+    while (stage.load() != 2) {
+      std::this_thread::yield();
+    }
+  });
+  while (stage.load() != 1) {
+    std::this_thread::yield();
+  }
+  epoch.retire(Node::make_node(NodeType::Leaf, "key", "val", alloc));
+  // the reader holds the epoch back, nothing may be freed
+  for (int i = 0; i < 10; i++) {
+    epoch.reclaim();
+  }
+  ASSERT_EQ(epoch.pending(), 1);
+  stage = 2;
+  reader.join();
+  for (int i = 0; i < 3; i++) {
+    epoch.reclaim();
+  }
+  ASSERT_EQ(epoch.pending(), 0);
+}
+
+TEST(EpochTest, nesting_test) {
+  NodeAllocator alloc(AllocPolicy::Heap);
+  EpochManager epoch(alloc);
+  {
+    auto outer = epoch.pin();
+    {
+      auto inner = epoch.pin();
+    }
+    // still pinned by outer
+    ASSERT_EQ(epoch.record().local.load() & 1, 1);
+  }
+  ASSERT_EQ(epoch.record().local.load(), 0);
+}
+
+TEST(EpochTest, threshold_test) {
+  NodeAllocator alloc(AllocPolicy::Heap);
+  EpochManager epoch(alloc);
+  // retiring alone reclaims, the list stays short
+  for (int i = 0; i < 10000; i++) {
+    auto guard = epoch.pin();
+    epoch.retire(Node::make_node(NodeType::Leaf, "key", "val", alloc));
+    ASSERT_LE(epoch.pending(), 4 * EpochManager::RECLAIM_THRESHOLD);
+  }
+  ASSERT_GT(epoch.epoch(), 0);
+  // the rest is freed by the destructor
+}
+
+TEST(EpochTest, dead_manager_test) {
+  NodeAllocator alloc(AllocPolicy::Heap);
+  EpochManager keep(alloc);
+  keep.pin();
+  // a thread that pinned many short-lived managers only keeps the entries
+  // of the ones still alive
+  for (int i = 0; i < 1000; i++) {
+    EpochManager epoch(alloc);
+    auto guard = epoch.pin();
+    ASSERT_LE(EpochManager::cache().entries.size(), 3);
+  }
+  EpochManager last(alloc);
+  last.pin();
+  ASSERT_EQ(EpochManager::cache().entries.size(), 2);
+  {
+    auto guard = keep.pin();
+    ASSERT_EQ(keep.record().local.load() & 1, 1);
+  }
+}
+
+TEST(EpochTest, thread_exit_test) {
+  NodeAllocator alloc(AllocPolicy::Heap);
+  EpochManager epoch(alloc);
+  epoch.pin();
+  // short-lived threads leave what they retired behind
+  for (int round = 0; round < 20; round++) {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+      threads.emplace_back([&] {
+        auto guard = epoch.pin();
+        for (int i = 0; i < 10; i++) {
+          epoch.retire(Node::make_node(NodeType::Leaf, "key", "val", alloc));
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    // their records are gone, only this thread's is left
+    std::lock_guard<std::mutex> lock(epoch.records_mutex_);
+    ASSERT_EQ(epoch.records_.size(), 1);
+  }
+  ASSERT_GT(epoch.orphans_.size(), 0);
+  // any thread's reclaim frees them, long before the manager goes
+  for (int i = 0; i < 4; i++) {
+    epoch.reclaim();
+  }
+  ASSERT_EQ(epoch.orphans_.size(), 0);
+  ASSERT_EQ(epoch.pending(), 0);
+}
+
+int main(int, char **) {
+  ::testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,262 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+#define private public
+#include "../mvcc.hpp"
+
+using namespace arttree;
+
+TEST(MvccTest, snapshot_read_test) {
+  MvccArtTree tree;
+  uint64_t ts1 = tree.put("a", "1");
+  tree.put("b", "1");
+  auto txn1 = tree.read();
+  ASSERT_EQ(txn1.timestamp(), tree.timestamp());
+
+  tree.put("a", "2");
+  tree.erase("b");
+  tree.put("c", "1");
+  std::string_view val;
+  // the old view does not move
+  ASSERT_TRUE(txn1.search("a", val));
+  ASSERT_EQ(val, "1");
+  ASSERT_TRUE(txn1.search("b", val));
+  ASSERT_FALSE(txn1.search("c", val));
+
+  std::string latest;
+  ASSERT_TRUE(tree.get("a", latest));
+  ASSERT_EQ(latest, "2");
+  ASSERT_FALSE(tree.get("b", latest));
+  ASSERT_TRUE(tree.get("c", latest));
+
+  auto at1 = tree.read_at(ts1);
+  ASSERT_TRUE(at1.has_value());
+  ASSERT_TRUE(at1->search("a", val));
+  ASSERT_FALSE(at1->search("b", val));
+  ASSERT_FALSE(tree.read_at(tree.timestamp() + 1).has_value());
+  at1.reset();
+
+  // the versions txn1 sees survive a collection
+  tree.gc();
+  ASSERT_TRUE(txn1.search("a", val));
+  ASSERT_EQ(val, "1");
+  ASSERT_TRUE(txn1.search("b", val));
+  // older than txn1, may be gone
+  ASSERT_FALSE(tree.read_at(ts1).has_value());
+
+  {
+    auto txn = std::move(txn1);
+  }
+  // nobody reads before now, the old versions and the erased key go
+  ASSERT_EQ(tree.gc(), 3);
+  ASSERT_EQ(tree.index_.size(), 2);
+  ASSERT_FALSE(tree.read_at(ts1).has_value());
+  ASSERT_TRUE(tree.get("a", latest));
+  ASSERT_EQ(latest, "2");
+  ASSERT_FALSE(tree.get("b", latest));
+  // an erased key can be written again
+  tree.put("b", "3");
+  ASSERT_TRUE(tree.get("b", latest));
+  ASSERT_EQ(latest, "3");
+}
+
+TEST(MvccTest, gc_test) {
+  MvccArtTree tree;
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < 1000; i++) {
+      tree.put(std::to_string(i), std::to_string(round));
+    }
+  }
+  ASSERT_EQ(tree.gc(), 2000);
+  ASSERT_EQ(tree.gc(), 0);
+  for (int i = 0; i < 1000; i++) {
+    tree.erase(std::to_string(i));
+  }
+  ASSERT_EQ(tree.gc(), 2000);
+  ASSERT_EQ(tree.index_.size(), 0);
+  ASSERT_TRUE(tree.gc_queue_.empty());
+}
+
+TEST(MvccTest, reader_slots_test) {
+  MvccArtTree tree;
+  constexpr size_t READERS = MvccArtTree::READER_SLOTS + 16;
+  std::deque<MvccArtTree::ReadTxn> txns;
+  for (size_t i = 0; i < READERS; i++) {
+    tree.put("k", std::to_string(i));
+    txns.push_back(tree.read());
+  }
+  // the readers past the slots are announced too
+  ASSERT_EQ(tree.overflow_.size(), 16);
+  for (int round = 0; round < 3; round++) {
+    tree.put("k", "new");
+  }
+  ASSERT_EQ(tree.gc(), 0);
+  for (size_t i = 0; i < READERS; i++) {
+    std::string_view val;
+    ASSERT_TRUE(txns[i].search("k", val));
+    ASSERT_EQ(val, std::to_string(i));
+  }
+  for (size_t i = 0; i < READERS / 2; i++) {
+    txns.pop_front();
+  }
+  ASSERT_EQ(tree.gc(), READERS / 2);
+  txns.clear();
+  ASSERT_TRUE(tree.overflow_.empty());
+  ASSERT_EQ(tree.gc(), READERS / 2 + 2);
+  // nothing below the horizon is handed out again
+  ASSERT_FALSE(tree.read_at(1).has_value());
+  ASSERT_TRUE(tree.read_at(tree.timestamp()).has_value());
+}
+
+TEST(MvccTest, gc_race_test) {
+  MvccArtTree tree;
+  constexpr int WRITES = 20000;
+  tree.put("k", "1");
+  std::atomic<bool> done{false};
+  std::atomic<bool> failed{false};
+
+  std::vector<std::thread> threads;
+  // the only writer, the value written at a timestamp is that timestamp
+  threads.emplace_back([&] {
+    for (int i = 2; i <= WRITES; i++) {
+      tree.put("k", std::to_string(i));
+    }
+    done = true;
+  });
+  threads.emplace_back([&] {
+    while (!done.load()) {
+      tree.gc();
+    }
+  });
+  for (int r = 0; r < 3; r++) {
+    threads.emplace_back([&] {
+      while (!done.load()) {
+        auto txn = tree.read();
+        auto old = tree.read_at(txn.timestamp() / 2 + 1);
+        std::this_thread::yield();
+        std::string_view val;
+        if (!txn.search("k", val) ||
+            val != std::to_string(txn.timestamp())) {
+          failed = true;
+        }
+        if (old && (!old->search("k", val) ||
+                    val != std::to_string(old->timestamp()))) {
+          failed = true;
+        }
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  ASSERT_FALSE(failed.load());
+  tree.gc();
+  ASSERT_EQ(tree.index_.size(), 1);
+}
+
+TEST(MvccTest, commit_order_test) {
+  MvccArtTree tree;
+  tree.put("a", "1");
+  // a writer that took a timestamp and has not committed yet
+  uint64_t stalled = tree.clock_.fetch_add(1) + 1;
+  std::atomic<uint64_t> ts{0};
+  std::thread writer([&] { ts = tree.put("a", "2"); });
+  std::this_thread::sleep_for(std::chrono::milliseconds{20});
+  // the later writer is linked but waits; readers are not held up
+  ASSERT_EQ(ts.load(), 0);
+  auto txn = tree.read();
+  ASSERT_EQ(txn.timestamp(), stalled - 1);
+  std::string_view val;
+  ASSERT_TRUE(txn.search("a", val));
+  ASSERT_EQ(val, "1");
+  // committing nothing at its timestamp, as a writer that threw does
+  tree.commit(stalled);
+  writer.join();
+  ASSERT_EQ(ts.load(), stalled + 1);
+  ASSERT_EQ(tree.timestamp(), stalled + 1);
+  std::string latest;
+  ASSERT_TRUE(tree.get("a", latest));
+  ASSERT_EQ(latest, "2");
+}
+
+TEST(MvccTest, concurrent_test) {
+  MvccArtTree tree(std::chrono::milliseconds{1});
+  constexpr int WRITERS = 3;
+  constexpr int WRITES = 2000;
+  std::atomic<bool> done{false};
+  std::atomic<bool> failed{false};
+
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 2; r++) {
+    readers.emplace_back([&] {
+      std::vector<long> last(WRITERS, -1);
+      while (!done.load()) {
+        auto txn = tree.read();
+        for (int t = 0; t < WRITERS; t++) {
+          std::string key = "counter" + std::to_string(t);
+          std::string_view v1, v2;
+          bool found = txn.search(key, v1);
+          // repeatable within the view
+          if (found != txn.search(key, v2) || (found && v1 != v2)) {
+            failed = true;
+          }
+          long n = found ? std::stol(std::string(v1)) : -1;
+          // never older than what an earlier view saw
+          if (n < last[t]) {
+            failed = true;
+          }
+          last[t] = n;
+        }
+      }
+    });
+  }
+  std::vector<std::thread> writers;
+  for (int t = 0; t < WRITERS; t++) {
+    writers.emplace_back([&, t] {
+      std::string key = "counter" + std::to_string(t);
+      for (int i = 0; i < WRITES; i++) {
+        tree.put(key, std::to_string(i));
+        // churn on keys that come and go
+        std::string temp = "temp" + std::to_string(i % 50);
+        if (i % 2) {
+          tree.put(temp, key);
+        } else {
+          tree.erase(temp);
+        }
+      }
+    });
+  }
+  for (auto &w : writers) {
+    w.join();
+  }
+  done = true;
+  for (auto &r : readers) {
+    r.join();
+  }
+  ASSERT_FALSE(failed.load());
+  ASSERT_EQ(tree.timestamp(), WRITERS * WRITES * 2);
+  for (int t = 0; t < WRITERS; t++) {
+    std::string val;
+    ASSERT_TRUE(tree.get("counter" + std::to_string(t), val));
+    ASSERT_EQ(val, std::to_string(WRITES - 1));
+  }
+}
+
+TEST(MvccTest, invalid_key_test) {
+  MvccArtTree tree;
+  std::string_view bad("a\0b", 3);
+  ASSERT_EQ(tree.put(bad, "v"), 0);
+  ASSERT_EQ(tree.erase(bad), 0);
+  ASSERT_EQ(tree.timestamp(), 0);
+  std::string val;
+  ASSERT_FALSE(tree.get(bad, val));
+}
+
+int main(int, char **) {
+  ::testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
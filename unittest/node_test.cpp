@@ -1,11 +1,21 @@
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <thread>
 #define private public
 #include "../art.hpp"
 
 using namespace arttree;
 
 TEST(NodeTest, node4_test) {
-  Node *n4 = Node::make_node(NodeType::Node4, "", "");
+  NodeAllocator alloc;
+  Node *n4 = Node::make_node(NodeType::Node4, "", "", alloc);
   Node leaf;
   n4->add_child('a', &leaf);
   n4->add_child('b', &leaf);
@@ -31,7 +41,7 @@ TEST(NodeTest, node4_test) {
   ASSERT_EQ(i, 4);
 
   // node4 with 3 children
-  Node *n4_2 = Node::make_node(NodeType::Node4, "", "");
+  Node *n4_2 = Node::make_node(NodeType::Node4, "", "", alloc);
   n4_2->add_child('a', &leaf);
   n4_2->add_child('b', &leaf);
   n4_2->add_child('c', &leaf);
@@ -47,13 +57,14 @@ TEST(NodeTest, node4_test) {
 
   ASSERT_EQ(i, 3);
 
-  delete n4;
-  delete n4_2;
+  Node::free_node(n4, alloc);
+  Node::free_node(n4_2, alloc);
 }
 
 // 16
 TEST(NodeTest, node16_test) {
-  Node *n16 = Node::make_node(NodeType::Node16, "", "");
+  NodeAllocator alloc;
+  Node *n16 = Node::make_node(NodeType::Node16, "", "", alloc);
   Node leaf;
   for (int i = 0; i < 16; i++) {
     n16->add_child('a' + i, &leaf);
@@ -76,7 +87,7 @@ TEST(NodeTest, node16_test) {
   }
 
   // 13 children
-  Node *n16_2 = Node::make_node(NodeType::Node16, "", "");
+  Node *n16_2 = Node::make_node(NodeType::Node16, "", "", alloc);
   for (int i = 0; i < 13; i++) {
     n16_2->add_child('a' + i, &leaf);
   }
@@ -90,12 +101,91 @@ TEST(NodeTest, node16_test) {
     ASSERT_EQ(key, 'a' + j - 1);
   }
 
-  delete n16;
+  Node::free_node(n16, alloc);
+  Node::free_node(n16_2, alloc);
+}
+
+TEST(NodeTest, node16_simd_test) {
+  NodeAllocator alloc;
+  std::mt19937 rng(7);
+  unsigned char keys[16];
+  for (int round = 0; round < 1000; round++) {
+    for (auto &k : keys) {
+      k = rng() % 8;
+    }
+    unsigned char ch = rng() % 8;
+    ASSERT_EQ(KeyMatch::equal16(keys, ch), KeyMatch::equal16_scalar(keys, ch));
+  }
+
+  // unused slots are zero and must not match byte 0
+  Node *n16 = Node::make_node(NodeType::Node16, "", "", alloc);
+  Node leaf;
+  for (int i = 0; i < 5; i++) {
+    n16->add_child(200 + i, &leaf);
+  }
+  ASSERT_EQ(n16->find_child(0), nullptr);
+  n16->add_child(0, &leaf);
+  ASSERT_EQ(n16->find_child(0), &n16->as<Node16>()->children[0]);
+  ASSERT_EQ(n16->find_child(204), &n16->as<Node16>()->children[5]);
+  Node::free_node(n16, alloc);
+}
+
+TEST(NodeTest, sorted_children_test) {
+  NodeAllocator alloc;
+  Node leaf;
+  std::mt19937 rng(5);
+  for (NodeType type : {NodeType::Node4, NodeType::Node16}) {
+    size_t cap = type == NodeType::Node4 ? 4 : 16;
+    std::vector<unsigned char> keys;
+    for (int i = 0; i < 256; i++) {
+      keys.push_back(i);
+    }
+    std::shuffle(keys.begin(), keys.end(), rng);
+    keys.resize(cap);
+
+    Node *n = Node::make_node(type, "", "", alloc);
+    for (unsigned char k : keys) {
+      ASSERT_TRUE(n->add_child(k, &leaf));
+    }
+    std::sort(keys.begin(), keys.end());
+
+    // iteration yields keys in order
+    std::vector<unsigned char> seen;
+    n->for_each_child([&](Node *, unsigned char k) { seen.push_back(k); });
+    ASSERT_EQ(seen, keys);
+
+    for (unsigned char k : keys) {
+      ASSERT_NE(n->find_child(k), nullptr);
+    }
+    for (int k = 0; k < 256; k++) {
+      if (!std::binary_search(keys.begin(), keys.end(), k)) {
+        ASSERT_EQ(n->find_child(k), nullptr);
+      }
+    }
+
+    // growing keeps the order
+    Node::grow(&n, alloc);
+    seen.clear();
+    n->for_each_child([&](Node *, unsigned char k) { seen.push_back(k); });
+    ASSERT_EQ(seen, keys);
+    Node::free_node(n, alloc);
+  }
+
+  unsigned char bytes[16];
+  for (int round = 0; round < 1000; round++) {
+    for (auto &b : bytes) {
+      b = rng();
+    }
+    unsigned char ch = rng();
+    ASSERT_EQ(KeyMatch::greater16(bytes, ch),
+              KeyMatch::greater16_scalar(bytes, ch));
+  }
 }
 
 // 48
 TEST(NodeTest, node48_test) {
-  Node *n48 = Node::make_node(NodeType::Node48, "", "");
+  NodeAllocator alloc;
+  Node *n48 = Node::make_node(NodeType::Node48, "", "", alloc);
   Node leaf;
   for (int i = 0; i < 48; i++) {
     ASSERT_TRUE(n48->add_child('a' + i, &leaf));
@@ -118,7 +208,7 @@ TEST(NodeTest, node48_test) {
   }
 
   // 21 children
-  Node *n48_2 = Node::make_node(NodeType::Node48, "", "");
+  Node *n48_2 = Node::make_node(NodeType::Node48, "", "", alloc);
   for (int i = 0; i < 21; i++) {
     ASSERT_TRUE(n48_2->add_child('a' + i, &leaf));
   }
@@ -132,12 +222,14 @@ TEST(NodeTest, node48_test) {
     ASSERT_EQ(key, 'a' + j - 1);
   }
 
-  delete n48;
+  Node::free_node(n48, alloc);
+  Node::free_node(n48_2, alloc);
 }
 
 // 256
 TEST(NodeTest, node256_test) {
-  Node *n256 = Node::make_node(NodeType::Node256, "", "");
+  NodeAllocator alloc;
+  Node *n256 = Node::make_node(NodeType::Node256, "", "", alloc);
   Node leaf;
   for (int i = 0; i < 256; i++) {
     n256->add_child(i, &leaf);
@@ -161,7 +253,7 @@ TEST(NodeTest, node256_test) {
   }
 
   // 21 children
-  Node *n256_2 = Node::make_node(NodeType::Node256, "", "");
+  Node *n256_2 = Node::make_node(NodeType::Node256, "", "", alloc);
   for (int i = 0; i < 21; i++) {
     ASSERT_TRUE(n256_2->add_child(i, &leaf));
   }
@@ -175,11 +267,14 @@ TEST(NodeTest, node256_test) {
     ASSERT_EQ(key, j - 1);
   }
 
-  delete n256;
+  Node::free_node(n256, alloc);
+  Node::free_node(n256_2, alloc);
 }
 
 TEST(NodeTest, grow_test) {
-  Node *n = Node::make_node(NodeType::Node4, "", "");
+  NodeAllocator alloc;
+  Node *n = Node::make_node(NodeType::Node4, "", "", alloc);
+  n->set_prefix((const unsigned char *)"abc", 3);
   // 插满
   std::vector<Node *> children;
   int i = 0;
@@ -187,7 +282,9 @@ TEST(NodeTest, grow_test) {
     children.push_back(new Node{});
     n->add_child('a' + i, children[i]);
   }
-  n->grow();
+  ASSERT_TRUE(n->is_full());
+  Node::grow(&n, alloc);
+  ASSERT_EQ(n->type, NodeType::Node16);
 
   // 迭代检查
   int j = 0;
@@ -201,7 +298,9 @@ TEST(NodeTest, grow_test) {
     children.push_back(new Node{});
     n->add_child('a' + i, children[i]);
   }
-  n->grow();
+  ASSERT_TRUE(n->is_full());
+  Node::grow(&n, alloc);
+  ASSERT_EQ(n->type, NodeType::Node48);
 
   // 迭代检查
   for (; j < 16; j++) {
@@ -211,18 +310,14 @@ TEST(NodeTest, grow_test) {
   // 插满
   for (; i < 48; i++) {
     children.push_back(new Node{});
-    std::cout << "add child " << i << " " << children[i] << std::endl;
-    if (i == 47) {
-      int m = 0;
-    }
     n->add_child('a' + i, children[i]);
   }
-
-  n->grow();
-  LOG_INFO << "grow 16 -> 48";
+  ASSERT_TRUE(n->is_full());
+  Node::grow(&n, alloc);
+  ASSERT_EQ(n->type, NodeType::Node256);
 
   // 迭代检查
-  for (; j < 48; j++) {
+  for (j = 0; j < 48; j++) {
     ASSERT_EQ(*n->find_child('a' + j), children[j]);
   }
 
@@ -230,32 +325,56 @@ TEST(NodeTest, grow_test) {
   // 插满
   for (; i < 256; i++) {
     children.push_back(new Node{});
-    n->add_child('a' + i, children[i]);
+    ASSERT_TRUE(n->add_child('a' + i, children[i]));
   }
 
   // 迭代检查
-  for (; j < 256; j++) {
+  for (j = 0; j < 256; j++) {
     ASSERT_EQ(*n->find_child('a' + j), children[j]);
   }
 
-  ASSERT_EQ(n->type, NodeType::Node16);
+  ASSERT_EQ(n->num_children, 256);
+  ASSERT_EQ(n->prefix_len, 3);
+  ASSERT_EQ(memcmp(n->prefix, "abc", 3), 0);
 
-  delete n;
+  for (Node *child : children) {
+    delete child;
+  }
+  Node::free_node(n, alloc);
 }
 
 TEST(NodeTest, node_leaf_test) {
-  Node *leaf = Node::make_node(NodeType::Leaf, "key", "val");
-  NodeLeaf *leaf2 = (NodeLeaf *)leaf->inner;
-  ASSERT_EQ(leaf->load_key(), "key");
+  NodeAllocator alloc;
+  Node *leaf = Node::make_node(NodeType::Leaf, "key", "val", alloc);
+  ASSERT_TRUE(Node::is_leaf(leaf));
+  NodeLeaf *leaf2 = Node::to_leaf(leaf);
+  ASSERT_EQ(Node::from_leaf(leaf2), leaf);
+  ASSERT_EQ(leaf2->load_key(), "key");
   ASSERT_EQ(leaf2->load_val(), "val");
-  delete leaf;
+  // key and value share the leaf's block
+  ASSERT_EQ((void *)leaf2->load_key().data(), (void *)(leaf2 + 1));
+  ASSERT_EQ(leaf2->load_val().data(), leaf2->load_key().data() + 3);
+
+  NodeLeaf *empty = NodeLeaf::make("", "", alloc);
+  ASSERT_EQ(empty->load_key(), "");
+  ASSERT_EQ(empty->load_val(), "");
+  NodeLeaf::free(empty, alloc);
+
+  // a tagged leaf sits in a child slot next to inner nodes
+  Node *n4 = Node::make_node(NodeType::Node4, "", "", alloc);
+  ASSERT_FALSE(Node::is_leaf(n4));
+  n4->add_child('k', leaf);
+  ASSERT_TRUE(Node::is_leaf(*n4->find_child('k')));
+  ASSERT_EQ(n4->first_leaf(), leaf2);
+  Node::free_node(n4, alloc);
+  Node::free_node(leaf, alloc);
 }
 
 TEST(NodeTest, node_insert_test) {
   ArtTree tree;
   tree.insert("abc", "abc");
-  ASSERT_EQ(tree.root_->is_leaf(), true);
-  ASSERT_EQ(tree.root_->load_key(), "abc");
+  ASSERT_EQ(Node::is_leaf(tree.root_), true);
+  ASSERT_EQ(Node::to_leaf(tree.root_)->load_key(), "abc");
 
   //  tree.print();
 
@@ -276,7 +395,1145 @@ TEST(NodeTest, node_insert_test) {
   ASSERT_EQ(val, "abcdf");
 
   tree.print();
-  int i;
+}
+
+TEST(NodeTest, long_prefix_test) {
+  ArtTree tree;
+  // the common prefix is longer than MAX_PREFIX_LEN
+  std::string base(40, 'x');
+  std::vector<std::string> keys = {base + "a", base + "b", base.substr(0, 20),
+                                   base.substr(0, 20) + "yz", base};
+  for (auto &k : keys) {
+    ASSERT_TRUE(tree.insert(k, k));
+  }
+  for (auto &k : keys) {
+    std::string_view val;
+    ASSERT_TRUE(tree.search(k, val));
+    ASSERT_EQ(val, k);
+  }
+  std::string_view val;
+  ASSERT_FALSE(tree.search(base.substr(0, 30), val));
+  ASSERT_FALSE(tree.search(std::string(25, 'x') + "q" + base, val));
+}
+
+TEST(NodeTest, random_insert_test) {
+  ArtTree tree;
+  std::map<std::string, std::string> expect;
+  std::mt19937 rng(42);
+  for (int i = 0; i < 20000; i++) {
+    std::string key;
+    size_t len = 1 + rng() % 24;
+    for (size_t j = 0; j < len; j++) {
+      // few distinct bytes so keys share long prefixes
+      key.push_back('a' + rng() % 6);
+    }
+    std::string val = std::to_string(i);
+    tree.insert(key, val);
+    expect[key] = val;
+  }
+  for (auto &[k, v] : expect) {
+    std::string_view val;
+    ASSERT_TRUE(tree.search(k, val)) << k;
+    ASSERT_EQ(val, v);
+  }
+  std::string_view val;
+  ASSERT_FALSE(tree.search("zzz", val));
+}
+
+TEST(NodeTest, allocator_test) {
+  // slab: a freed node is handed out again for the same size
+  NodeAllocator slab{AllocPolicy::Slab};
+  Node *n4 = Node::make_node(NodeType::Node4, "", "", slab);
+  Node::free_node(n4, slab);
+  Node *n4_2 = Node::make_node(NodeType::Node4, "", "", slab);
+  ASSERT_EQ(n4, n4_2);
+  Node *n16 = Node::make_node(NodeType::Node16, "", "", slab);
+  ASSERT_NE((void *)n16, (void *)n4_2);
+  ASSERT_EQ(slab.chunk_count(), 1);
+
+  // blocks stay aligned for leaf tagging
+  for (size_t len = 0; len < 40; len++) {
+    NodeLeaf *leaf = NodeLeaf::make(std::string(len, 'k'), "v", slab);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(leaf) % 8, 0);
+  }
+
+  // values larger than a pooled block live outside the chunks
+  std::string big(10000, 'v');
+  NodeLeaf *large = NodeLeaf::make("k", big, slab);
+  ASSERT_EQ(large->load_val(), big);
+  NodeLeaf::free(large, slab);
+  large = NodeLeaf::make("k", big, slab);
+  slab.release();
+  ASSERT_EQ(slab.chunk_count(), 0);
+
+  // arena: freeing is a no-op
+  NodeAllocator arena{AllocPolicy::Arena};
+  Node *a = Node::make_node(NodeType::Node4, "", "", arena);
+  Node::free_node(a, arena);
+  Node *b = Node::make_node(NodeType::Node4, "", "", arena);
+  ASSERT_NE(a, b);
+  ASSERT_TRUE(arena.frees_in_bulk());
+
+  NodeAllocator heap{AllocPolicy::Heap};
+  ASSERT_FALSE(heap.frees_in_bulk());
+  Node *h = Node::make_node(NodeType::Node256, "", "", heap);
+  Node::free_node(h, heap);
+  ASSERT_EQ(heap.chunk_count(), 0);
+}
+
+TEST(NodeTest, alloc_policy_tree_test) {
+  for (AllocPolicy policy :
+       {AllocPolicy::Heap, AllocPolicy::Slab, AllocPolicy::Arena}) {
+    ArtTree tree{policy};
+    std::map<std::string, std::string> expect;
+    std::mt19937 rng(11);
+    for (int i = 0; i < 5000; i++) {
+      std::string key = std::to_string(rng() % 3000);
+      std::string val(rng() % 64, 'a' + i % 26);
+      tree.insert(key, val);
+      expect[key] = val;
+    }
+    for (auto &[k, v] : expect) {
+      std::string_view val;
+      ASSERT_TRUE(tree.search(k, val));
+      ASSERT_EQ(val, v);
+    }
+  }
+}
+
+TEST(NodeTest, erase_test) {
+  ArtTree tree{AllocPolicy::Heap};
+  tree.insert("abc", "1");
+  tree.insert("abcd", "2");
+  tree.insert("abcdef1", "3");
+  tree.insert("abcdef2", "4");
+
+  std::string_view val;
+  ASSERT_FALSE(tree.erase("ab"));
+  ASSERT_FALSE(tree.erase("abcdef"));
+  ASSERT_FALSE(tree.erase("abcdef3"));
+
+  ASSERT_TRUE(tree.erase("abcdef1"));
+  ASSERT_FALSE(tree.search("abcdef1", val));
+  ASSERT_TRUE(tree.search("abcdef2", val));
+  ASSERT_EQ(val, "4");
+  ASSERT_FALSE(tree.erase("abcdef1"));
+
+  ASSERT_TRUE(tree.erase("abc"));
+  ASSERT_TRUE(tree.search("abcd", val));
+  ASSERT_EQ(val, "2");
+  ASSERT_TRUE(tree.search("abcdef2", val));
+
+  ASSERT_TRUE(tree.erase("abcd"));
+  // a single key is left, the root collapses to its leaf
+  ASSERT_TRUE(Node::is_leaf(tree.root_));
+  ASSERT_TRUE(tree.search("abcdef2", val));
+
+  ASSERT_TRUE(tree.erase("abcdef2"));
+  ASSERT_EQ(tree.root_, nullptr);
+  ASSERT_FALSE(tree.erase("abcdef2"));
+}
+
+TEST(NodeTest, erase_shrink_test) {
+  ArtTree tree{AllocPolicy::Heap};
+  std::string prefix(30, 'p');
+  // slot 0 holds the key that ends at the node, keys have no 0 bytes
+  auto key = [&](int i) {
+    return i == 0 ? prefix : prefix + std::string(1, (char)i) + "tail";
+  };
+  for (int i = 0; i < 256; i++) {
+    tree.insert(key(i), std::to_string(i));
+  }
+  ASSERT_EQ(tree.root_->type, NodeType::Node256);
+  ASSERT_EQ(tree.root_->prefix_len, 30);
+
+  std::vector<std::pair<int, NodeType>> steps = {
+      {ArtTreeDefs::NODE256_SHRINK, NodeType::Node48},
+      {ArtTreeDefs::NODE48_SHRINK, NodeType::Node16},
+      {ArtTreeDefs::NODE16_SHRINK, NodeType::Node4}};
+  int i = 255;
+  for (auto [remain, type] : steps) {
+    for (; i >= remain; i--) {
+      ASSERT_TRUE(tree.erase(key(i)));
+    }
+    ASSERT_EQ(tree.root_->type, type);
+    ASSERT_EQ(tree.root_->num_children, remain);
+    ASSERT_EQ(tree.root_->prefix_len, 30);
+    for (int j = 0; j < remain; j++) {
+      std::string_view val;
+      ASSERT_TRUE(tree.search(key(j), val));
+      ASSERT_EQ(val, std::to_string(j));
+    }
+  }
+}
+
+TEST(NodeTest, erase_merge_prefix_test) {
+  ArtTree tree{AllocPolicy::Heap};
+  // root prefix "x...x" (20), then "a" + inner node with prefix "y...y" (25)
+  std::string p1(20, 'x'), p2(25, 'y');
+  tree.insert(p1 + "a" + p2 + "1", "1");
+  tree.insert(p1 + "a" + p2 + "2", "2");
+  tree.insert(p1 + "b", "3");
+  ASSERT_EQ(tree.root_->prefix_len, 20);
+
+  ASSERT_TRUE(tree.erase(p1 + "b"));
+  // the root merged with its child: prefix p1 + "a" + p2
+  ASSERT_FALSE(Node::is_leaf(tree.root_));
+  ASSERT_EQ(tree.root_->prefix_len, 46);
+  std::string merged = p1 + "a" + p2;
+  ASSERT_EQ(memcmp(tree.root_->prefix, merged.data(),
+                   ArtTreeDefs::MAX_PREFIX_LEN),
+            0);
+
+  std::string_view val;
+  ASSERT_TRUE(tree.search(p1 + "a" + p2 + "1", val));
+  ASSERT_EQ(val, "1");
+  ASSERT_FALSE(tree.search(p1 + "a" + p2, val));
+  // a split after the merge needs the recovered prefix bytes
+  tree.insert(p1 + "a" + std::string(10, 'y') + "z", "4");
+  ASSERT_TRUE(tree.search(p1 + "a" + std::string(10, 'y') + "z", val));
+  ASSERT_EQ(val, "4");
+  ASSERT_TRUE(tree.search(p1 + "a" + p2 + "2", val));
+  ASSERT_EQ(val, "2");
+}
+
+TEST(NodeTest, random_erase_test) {
+  for (AllocPolicy policy : {AllocPolicy::Heap, AllocPolicy::Slab}) {
+    ArtTree tree{policy};
+    std::map<std::string, std::string> expect;
+    std::mt19937 rng(3);
+    auto random_key = [&] {
+      std::string key;
+      size_t len = 1 + rng() % 30;
+      for (size_t j = 0; j < len; j++) {
+        key.push_back('a' + rng() % 4);
+      }
+      return key;
+    };
+    for (int round = 0; round < 20000; round++) {
+      std::string key = random_key();
+      if (rng() % 3 == 0) {
+        ASSERT_EQ(tree.erase(key), expect.erase(key) == 1) << key;
+      } else {
+        tree.insert(key, key);
+        expect[key] = key;
+      }
+    }
+    for (auto &[k, v] : expect) {
+      std::string_view val;
+      ASSERT_TRUE(tree.search(k, val)) << k;
+      ASSERT_EQ(val, v);
+    }
+    for (auto &[k, v] : expect) {
+      ASSERT_TRUE(tree.erase(k)) << k;
+    }
+    ASSERT_EQ(tree.root_, nullptr);
+  }
+}
+
+TEST(NodeTest, upsert_test) {
+  ArtTree tree{AllocPolicy::Heap};
+  ASSERT_TRUE(tree.insert_or_assign("key", "value1"));
+  ASSERT_TRUE(tree.insert_or_assign("key2", "x"));
+  ASSERT_EQ(tree.size(), 2);
+
+  // a value that fits is written into the same leaf
+  Node **slot = tree.find_slot("key");
+  NodeLeaf *leaf = Node::to_leaf(*slot);
+  ASSERT_FALSE(tree.insert_or_assign("key", "value2"));
+  ASSERT_EQ(Node::to_leaf(*tree.find_slot("key")), leaf);
+  ASSERT_FALSE(tree.insert_or_assign("key", "v"));
+  ASSERT_EQ(Node::to_leaf(*tree.find_slot("key")), leaf);
+  std::string_view val;
+  ASSERT_TRUE(tree.search("key", val));
+  ASSERT_EQ(val, "v");
+
+  // a larger value reallocates the leaf
+  std::string big(100, 'b');
+  ASSERT_FALSE(tree.insert_or_assign("key", big));
+  ASSERT_TRUE(tree.search("key", val));
+  ASSERT_EQ(val, big);
+  ASSERT_EQ(tree.size(), 2);
+
+  // the duplicate insert is no longer lost
+  tree.insert("key2", "y");
+  ASSERT_TRUE(tree.search("key2", val));
+  ASSERT_EQ(val, "y");
+
+  ASSERT_FALSE(tree.try_emplace("key2", "z"));
+  ASSERT_TRUE(tree.search("key2", val));
+  ASSERT_EQ(val, "y");
+  ASSERT_TRUE(tree.try_emplace("key3", "z"));
+  ASSERT_EQ(tree.size(), 3);
+
+  auto incr = [](std::optional<std::string_view> old) {
+    return std::to_string(old ? std::stoi(std::string(*old)) + 1 : 0);
+  };
+  ASSERT_TRUE(tree.update("counter", incr));
+  for (int i = 0; i < 200; i++) {
+    ASSERT_FALSE(tree.update("counter", incr));
+  }
+  ASSERT_TRUE(tree.search("counter", val));
+  ASSERT_EQ(val, "200");
+
+  // the new value may be a view of the old one
+  ASSERT_FALSE(tree.update("key", [](std::optional<std::string_view> old) {
+    return old->substr(10);
+  }));
+  ASSERT_TRUE(tree.search("key", val));
+  ASSERT_EQ(val, big.substr(10));
+  ASSERT_EQ(tree.size(), 4);
+
+  ASSERT_TRUE(tree.erase("counter"));
+  ASSERT_EQ(tree.size(), 3);
+}
+
+TEST(NodeTest, insert_if_absent_test) {
+  ArtTree tree{AllocPolicy::Arena};
+  for (int i = 0; i < 100; i++) {
+    ASSERT_TRUE(tree.insert_if_absent("key" + std::to_string(i), "v"));
+  }
+  // an existing key allocates nothing, not even a temporary leaf
+  char *bump = tree.alloc_.cur_;
+  for (int i = 0; i < 100; i++) {
+    ASSERT_FALSE(tree.insert_if_absent("key" + std::to_string(i), "other"));
+  }
+  ASSERT_EQ(tree.alloc_.cur_, bump);
+  ASSERT_FALSE(tree.insert_or_assign("key7", "w"));
+  ASSERT_EQ(tree.alloc_.cur_, bump);
+
+  std::string_view val;
+  ASSERT_TRUE(tree.search("key7", val));
+  ASSERT_EQ(val, "w");
+  ASSERT_TRUE(tree.search("key8", val));
+  ASSERT_EQ(val, "v");
+  ASSERT_EQ(tree.size(), 100);
+}
+
+TEST(NodeTest, deep_insert_test) {
+  // every key extends the previous one, one tree level per key
+  ArtTree tree;
+  std::string key;
+  for (int i = 0; i < 3000; i++) {
+    key.push_back('a' + i % 3);
+    ASSERT_TRUE(tree.insert_if_absent(key, std::to_string(i)));
+  }
+  key.clear();
+  for (int i = 0; i < 3000; i++) {
+    key.push_back('a' + i % 3);
+    std::string_view val;
+    ASSERT_TRUE(tree.search(key, val));
+    ASSERT_EQ(val, std::to_string(i));
+  }
+  ASSERT_EQ(tree.size(), 3000);
+}
+
+TEST(NodeTest, iterator_test) {
+  ArtTree empty;
+  ASSERT_TRUE(empty.begin() == empty.end());
+
+  ArtTree tree;
+  tree.insert("only", "1");
+  auto it = tree.begin();
+  ASSERT_EQ(it.key(), "only");
+  ASSERT_EQ(it.value(), "1");
+  ++it;
+  ASSERT_TRUE(it == tree.end());
+
+  std::map<std::string, std::string> expect;
+  std::mt19937 rng(9);
+  for (int i = 0; i < 20000; i++) {
+    std::string key;
+    size_t len = 1 + rng() % 12;
+    for (size_t j = 0; j < len; j++) {
+      // wide byte range so every node type shows up
+      key.push_back(1 + rng() % (i % 2 ? 4 : 255));
+    }
+    tree.insert(key, std::to_string(i));
+    expect[key] = std::to_string(i);
+  }
+  expect["only"] = "1";
+
+  auto expect_it = expect.begin();
+  size_t n = 0;
+  for (auto [k, v] : tree) {
+    ASSERT_NE(expect_it, expect.end());
+    ASSERT_EQ(k, expect_it->first);
+    ASSERT_EQ(v, expect_it->second);
+    ++expect_it;
+    n++;
+  }
+  ASSERT_EQ(n, expect.size());
+  ASSERT_EQ(n, tree.size());
+}
+
+TEST(NodeTest, lower_bound_test) {
+  ArtTree empty;
+  ASSERT_TRUE(empty.lower_bound("a") == empty.end());
+
+  ArtTree tree;
+  std::map<std::string, std::string> expect;
+  std::mt19937 rng(12);
+  // long shared prefixes take the path where the prefix is read from a leaf
+  const std::string tenants[] = {"", "tenant/", "tenant/0123456789abcdef/",
+                                 "tenant/0123456789abcdefgh/"};
+  auto random_key = [&] {
+    std::string key = tenants[rng() % 4];
+    size_t len = 1 + rng() % 6;
+    for (size_t j = 0; j < len; j++) {
+      key.push_back(1 + rng() % (j % 2 ? 4 : 255));
+    }
+    return key;
+  };
+  for (int i = 0; i < 5000; i++) {
+    std::string key = random_key();
+    tree.insert(key, std::to_string(i));
+    expect[key] = std::to_string(i);
+  }
+
+  auto check = [&](const std::string &probe) {
+    auto lb = tree.lower_bound(probe);
+    auto expect_lb = expect.lower_bound(probe);
+    if (expect_lb == expect.end()) {
+      ASSERT_TRUE(lb == tree.end());
+    } else {
+      ASSERT_TRUE(lb != tree.end());
+      ASSERT_EQ(lb.key(), expect_lb->first);
+      ASSERT_EQ(lb.value(), expect_lb->second);
+    }
+    auto ub = tree.upper_bound(probe);
+    auto expect_ub = expect.upper_bound(probe);
+    if (expect_ub == expect.end()) {
+      ASSERT_TRUE(ub == tree.end());
+    } else {
+      ASSERT_TRUE(ub != tree.end());
+      ASSERT_EQ(ub.key(), expect_ub->first);
+    }
+  };
+  for (int i = 0; i < 5000; i++) {
+    check(random_key());
+  }
+  for (auto &[k, v] : expect) {
+    check(k);
+    check(k.substr(0, k.size() - 1));
+  }
+  check("");
+  check("\xff\xff");
+  check("tenant/0123456789abcdef");
+  check("tenant/0123456789abcdeg");
+  check("tenant/0123456789abcdefgh/\xff");
+
+  // range scan, as [from, to)
+  size_t n = 0;
+  auto last = tree.lower_bound("tenant/1");
+  for (auto it = tree.lower_bound("tenant/0"); it != last; ++it) {
+    ASSERT_EQ(it.key().substr(0, 8), "tenant/0");
+    n++;
+  }
+  ASSERT_EQ(n, std::distance(expect.lower_bound("tenant/0"),
+                             expect.lower_bound("tenant/1")));
+  ASSERT_GT(n, 0);
+}
+
+TEST(NodeTest, scan_prefix_test) {
+  ArtTree tree;
+  ASSERT_TRUE(tree.scan_prefix("a", [](auto, auto) { return true; }));
+
+  std::map<std::string, std::string> expect;
+  std::mt19937 rng(13);
+  const std::string tenants[] = {"tenant/1/", "tenant/12/",
+                                 "tenant/0123456789abcdefgh/", "user/"};
+  for (int i = 0; i < 5000; i++) {
+    std::string key = tenants[rng() % 4];
+    size_t len = rng() % 5;
+    for (size_t j = 0; j < len; j++) {
+      key.push_back('a' + rng() % 26);
+    }
+    tree.insert(key, std::to_string(i));
+    expect[key] = std::to_string(i);
+  }
+
+  auto check = [&](const std::string &prefix) {
+    std::vector<std::string> got;
+    ASSERT_TRUE(tree.scan_prefix(prefix, [&](auto k, auto v) {
+      EXPECT_EQ(v, expect[std::string(k)]);
+      got.emplace_back(k);
+      return true;
+    }));
+    std::vector<std::string> want;
+    for (auto it = expect.lower_bound(prefix); it != expect.end(); ++it) {
+      if (it->first.compare(0, prefix.size(), prefix) != 0) {
+        break;
+      }
+      want.push_back(it->first);
+    }
+    ASSERT_EQ(got, want) << prefix;
+  };
+  for (auto prefix :
+       {"", "t", "tenant/", "tenant/1", "tenant/1/", "tenant/12/a",
+        "tenant/0123456789abcdefg", "tenant/0123456789abcdefgh/b",
+        "tenant/0123456789abcdefgx", "user/zz", "x", "tenant/2"}) {
+    check(prefix);
+  }
+  for (int i = 0; i < 200; i++) {
+    auto it = expect.begin();
+    std::advance(it, rng() % expect.size());
+    check(it->first);
+  }
+
+  // a single leaf
+  ArtTree one;
+  one.insert("abc", "1");
+  size_t n = 0;
+  one.scan_prefix("ab", [&](auto, auto) { return ++n, true; });
+  one.scan_prefix("abd", [&](auto, auto) { return ++n, true; });
+  one.scan_prefix("abcd", [&](auto, auto) { return ++n, true; });
+  ASSERT_EQ(n, 1);
+
+  // early termination
+  n = 0;
+  ASSERT_FALSE(
+      tree.scan_prefix("tenant/", [&](auto, auto) { return ++n < 10; }));
+  ASSERT_EQ(n, 10);
+}
+
+TEST(NodeTest, reverse_iterator_test) {
+  ArtTree tree;
+  std::string_view k, v;
+  ASSERT_FALSE(tree.minimum(k, v));
+  ASSERT_FALSE(tree.maximum(k, v));
+  ASSERT_TRUE(tree.rbegin() == tree.rend());
+
+  tree.insert("only", "1");
+  ASSERT_TRUE(tree.minimum(k, v));
+  ASSERT_EQ(k, "only");
+  ASSERT_TRUE(tree.maximum(k, v));
+  ASSERT_EQ(k, "only");
+  ASSERT_EQ((--tree.end()).key(), "only");
+
+  std::map<std::string, std::string> expect;
+  std::mt19937 rng(14);
+  for (int i = 0; i < 20000; i++) {
+    // big-endian timestamps next to random keys, so every node type shows up
+    std::string key;
+    if (i % 2) {
+      uint64_t ts = 1700000000000ull + rng() % 100000;
+      for (int j = 7; j >= 0; j--) {
+        key.push_back(1 + (ts >> (j * 8)) % 255);
+      }
+    } else {
+      size_t len = 1 + rng() % 10;
+      for (size_t j = 0; j < len; j++) {
+        key.push_back(1 + rng() % (j % 2 ? 4 : 255));
+      }
+    }
+    tree.insert(key, std::to_string(i));
+    expect[key] = std::to_string(i);
+  }
+  expect["only"] = "1";
+
+  ASSERT_TRUE(tree.minimum(k, v));
+  ASSERT_EQ(k, expect.begin()->first);
+  ASSERT_TRUE(tree.maximum(k, v));
+  ASSERT_EQ(k, expect.rbegin()->first);
+  ASSERT_EQ(v, expect.rbegin()->second);
+
+  auto expect_it = expect.rbegin();
+  size_t n = 0;
+  for (auto it = tree.rbegin(); it != tree.rend(); ++it) {
+    ASSERT_NE(expect_it, expect.rend());
+    ASSERT_EQ(it.key(), expect_it->first);
+    ASSERT_EQ(it.value(), expect_it->second);
+    ++expect_it;
+    n++;
+  }
+  ASSERT_EQ(n, expect.size());
+
+  // step back and forth from random positions
+  for (int i = 0; i < 1000; i++) {
+    auto e = expect.begin();
+    std::advance(e, rng() % expect.size());
+    auto it = tree.lower_bound(e->first);
+    for (int j = 0; j < 5 && e != expect.begin(); j++) {
+      --it;
+      --e;
+      ASSERT_EQ(it.key(), e->first);
+    }
+    for (int j = 0; j < 5 && std::next(e) != expect.end(); j++) {
+      ++it;
+      ++e;
+      ASSERT_EQ(it.key(), e->first);
+    }
+  }
+  auto first = tree.begin();
+  first.prev();
+  ASSERT_TRUE(first == tree.end());
+}
+
+TEST(NodeTest, multi_search_test) {
+  ArtTree tree;
+  std::vector<std::string> keys;
+  std::mt19937 rng(15);
+  for (int i = 0; i < 20000; i++) {
+    std::string key;
+    size_t len = 1 + rng() % 24;
+    for (size_t j = 0; j < len; j++) {
+      key.push_back(1 + rng() % (j % 3 ? 4 : 255));
+    }
+    keys.push_back(key);
+  }
+  std::vector<std::string_view> probe(keys.begin(), keys.end());
+  std::vector<std::optional<std::string_view>> out(probe.size());
+  tree.multi_search(probe, out);
+  for (auto &v : out) {
+    ASSERT_FALSE(v.has_value());
+  }
+
+  for (size_t i = 0; i < keys.size(); i += 2) {
+    tree.insert(keys[i], keys[i] + "/val");
+  }
+  // batch sizes below, at and above the group size, and misses
+  for (size_t batch : {1, 7, 16, 64, 512, 20000}) {
+    for (size_t start = 0; start + batch <= probe.size(); start += batch * 7) {
+      std::span<const std::string_view> in(probe.data() + start, batch);
+      tree.multi_search(in, std::span(out.data(), batch));
+      for (size_t i = 0; i < batch; i++) {
+        std::string_view expect;
+        if (tree.search(in[i], expect)) {
+          ASSERT_EQ(out[i], expect);
+        } else {
+          ASSERT_FALSE(out[i].has_value());
+        }
+      }
+    }
+  }
+
+  ArtTree one;
+  one.insert("a", "1");
+  std::string_view two[] = {"a", "b"};
+  std::optional<std::string_view> res[2];
+  one.multi_search(two, 2, res);
+  ASSERT_EQ(res[0], "1");
+  ASSERT_FALSE(res[1].has_value());
+}
+
+TEST(NodeTest, bulk_load_test) {
+  std::map<std::string, std::string> expect;
+  std::vector<std::pair<std::string, std::string>> input;
+  std::mt19937 rng(17);
+  for (int i = 0; i < 30000; i++) {
+    std::string key = i % 5 ? "tenant/0123456789abcdefgh/" : "";
+    size_t len = 1 + rng() % 12;
+    for (size_t j = 0; j < len; j++) {
+      key.push_back(1 + rng() % (j % 2 ? 4 : 255));
+    }
+    input.emplace_back(key, std::to_string(i));
+  }
+  std::stable_sort(input.begin(), input.end(), [](auto &a, auto &b) {
+    return a.first < b.first;
+  });
+  ArtTree inserted;
+  for (auto &[k, v] : input) {
+    expect[k] = v;
+    inserted.insert(k, v);
+  }
+
+  ArtTree tree;
+  tree.bulk_load(input);
+  ASSERT_EQ(tree.size(), expect.size());
+  auto expect_it = expect.begin();
+  for (auto [k, v] : tree) {
+    ASSERT_EQ(k, expect_it->first);
+    ASSERT_EQ(v, expect_it->second);
+    ++expect_it;
+  }
+  ASSERT_TRUE(expect_it == expect.end());
+
+  // same shape as the tree built by inserts, down to the node types
+  std::function<void(Node *, Node *)> same = [&](Node *a, Node *b) {
+    ASSERT_EQ(Node::is_leaf(a), Node::is_leaf(b));
+    if (Node::is_leaf(a)) {
+      ASSERT_EQ(Node::to_leaf(a)->load_key(), Node::to_leaf(b)->load_key());
+      return;
+    }
+    ASSERT_EQ(a->type, b->type);
+    ASSERT_EQ(a->prefix_len, b->prefix_len);
+    ASSERT_EQ(memcmp(a->prefix, b->prefix, a->stored_prefix_len()), 0);
+    ASSERT_EQ(a->num_children, b->num_children);
+    NodeIterator ia(a), ib(b);
+    for (; !ia.at_end(); ++ia, ++ib) {
+      ASSERT_EQ((*ia).second, (*ib).second);
+      same((*ia).first, (*ib).first);
+    }
+  };
+  same(tree.root_, inserted.root_);
+
+  // the loaded tree takes updates and erases like any other
+  for (auto &[k, v] : expect) {
+    ASSERT_FALSE(tree.insert_or_assign(k, "x"));
+  }
+  for (auto &[k, v] : expect) {
+    ASSERT_TRUE(tree.erase(k));
+  }
+  ASSERT_EQ(tree.size(), 0);
+
+  ArtTree one;
+  std::pair<std::string_view, std::string_view> single[] = {{"a", "1"},
+                                                            {"a", "2"}};
+  one.bulk_load(single);
+  std::string_view val;
+  ASSERT_EQ(one.size(), 1);
+  ASSERT_TRUE(one.search("a", val));
+  ASSERT_EQ(val, "2");
+  // into a non-empty tree the pairs are inserted
+  std::pair<std::string_view, std::string_view> more[] = {{"ab", "3"}};
+  one.bulk_load(more);
+  ASSERT_EQ(one.size(), 2);
+  ASSERT_TRUE(one.search("ab", val));
+}
+
+TEST(NodeTest, parallel_bulk_load_test) {
+  ThreadPool pool(4);
+  std::map<std::string, std::string> expect;
+  std::vector<std::pair<std::string, std::string>> input;
+  std::mt19937 rng(18);
+  for (int i = 0; i < 50000; i++) {
+    std::string key = "shared/";
+    size_t len = 1 + rng() % 10;
+    for (size_t j = 0; j < len; j++) {
+      key.push_back(1 + rng() % (j % 2 ? 4 : 255));
+    }
+    input.emplace_back(key, std::to_string(i));
+    expect[key] = std::to_string(i);
+  }
+  // duplicates out of order, the later one wins
+  input.emplace_back(input[10].first, "dup");
+  expect[input[10].first] = "dup";
+  input.emplace_back("shared/", "short");
+  expect["shared/"] = "short";
+
+  for (auto policy : {AllocPolicy::Heap, AllocPolicy::Slab}) {
+    ArtTree tree(policy);
+    tree.bulk_load(input, pool);
+    ASSERT_EQ(tree.size(), expect.size());
+    auto expect_it = expect.begin();
+    for (auto [k, v] : tree) {
+      ASSERT_EQ(k, expect_it->first);
+      ASSERT_EQ(v, expect_it->second);
+      ++expect_it;
+    }
+    ASSERT_EQ(tree.root_->prefix_len, 7);
+    for (auto &[k, v] : expect) {
+      ASSERT_TRUE(tree.erase(k));
+    }
+  }
+
+  // sorted input takes the same path
+  std::vector<std::pair<std::string, std::string>> sorted(expect.begin(),
+                                                          expect.end());
+  ArtTree tree;
+  tree.bulk_load(sorted, pool);
+  ArtTree serial;
+  serial.bulk_load(sorted);
+  ASSERT_TRUE(std::equal(tree.begin(), tree.end(), serial.begin(),
+                         serial.end()));
+
+  ArtTree one;
+  std::pair<std::string, std::string> same[] = {{"k", "1"}, {"k", "2"}};
+  one.bulk_load(same, pool);
+  std::string_view val;
+  ASSERT_TRUE(one.search("k", val));
+  ASSERT_EQ(val, "2");
+  ASSERT_EQ(one.size(), 1);
+}
+
+TEST(NodeTest, thread_pool_test) {
+  ThreadPool pool(3);
+  std::atomic<int> sum{0};
+  // tasks that spawn tasks, stolen across workers
+  std::function<void(int)> spawn = [&](int depth) {
+    sum++;
+    if (depth < 10) {
+      pool.submit([&, depth] { spawn(depth + 1); });
+      pool.submit([&, depth] { spawn(depth + 1); });
+    }
+  };
+  pool.submit([&] { spawn(0); });
+  pool.wait();
+  ASSERT_EQ(sum.load(), (1 << 11) - 1);
+  pool.wait();
+  ASSERT_EQ(pool.queued_, 0);
+}
+
+TEST(NodeTest, thread_pool_group_test) {
+  ThreadPool pool(2);
+  // a throwing task neither kills its worker nor hangs wait()
+  std::atomic<int> ran{0};
+  for (int i = 0; i < 20; i++) {
+    pool.submit([&, i] {
+      ran++;
+      if (i % 5 == 0) {
+        throw std::runtime_error("task failed");
+      }
+    });
+  }
+  ASSERT_THROW(pool.wait(), std::runtime_error);
+  ASSERT_EQ(ran.load(), 20);
+  // reported once
+  pool.wait();
+
+  // a group waits for its own tasks, not for a long task of another caller
+  std::atomic<bool> started{false};
+  std::atomic<bool> release{false};
+  pool.submit([&] {
+    started = true;
+    while (!release) {
+      std::this_thread::yield();
+    }
+  });
+  while (!started) {
+    std::this_thread::yield();
+  }
+  ThreadPool::Group group;
+  std::atomic<int> mine{0};
+  for (int i = 0; i < 100; i++) {
+    pool.submit(group, [&] { mine++; });
+  }
+  pool.wait(group);
+  ASSERT_EQ(mine.load(), 100);
+  ASSERT_FALSE(release.load());
+
+  ThreadPool::Group failing;
+  pool.submit(failing, [] { throw std::logic_error("group task failed"); });
+  ASSERT_THROW(pool.wait(failing), std::logic_error);
+  release = true;
+  pool.wait();
+}
+
+static std::map<std::string, std::string> dump(const ArtTree &tree) {
+  std::map<std::string, std::string> out;
+  for (auto it = tree.begin(); it != tree.end(); ++it) {
+    out.emplace(it.key(), it.value());
+  }
+  return out;
+}
+
+TEST(NodeTest, bulk_load_unsorted_test) {
+  // the sorted run is built bottom-up, the rest inserted one by one
+  std::vector<std::pair<std::string, std::string>> input = {
+      {"apple", "1"}, {"apricot", "2"}, {"banana", "3"}, {"abc", "4"},
+      {"banana", "5"}, {"cherry", "6"}, {"apple", "7"}};
+  std::map<std::string, std::string> expect;
+  for (auto &[k, v] : input) {
+    expect[k] = v;
+  }
+  ArtTree tree;
+  tree.bulk_load(input);
+  ASSERT_EQ(tree.size(), expect.size());
+  ASSERT_EQ(dump(tree), expect);
+  for (auto &[k, v] : expect) {
+    std::string_view val;
+    ASSERT_TRUE(tree.search(k, val)) << k;
+    ASSERT_EQ(val, v);
+  }
+
+  // out of order from the second pair on
+  ArtTree reversed;
+  std::vector<std::pair<std::string, std::string>> down = {
+      {"c", "1"}, {"b", "2"}, {"a", "3"}};
+  reversed.bulk_load(down);
+  ASSERT_EQ(dump(reversed), (std::map<std::string, std::string>{
+                                {"a", "3"}, {"b", "2"}, {"c", "1"}}));
+}
+
+TEST(NodeTest, snapshot_test) {
+  for (auto policy : {AllocPolicy::Heap, AllocPolicy::Slab}) {
+    ArtTree tree(policy);
+    std::map<std::string, std::string> expect;
+    std::mt19937 rng(23);
+    auto random_key = [&] {
+      std::string key(1 + rng() % 10, 0);
+      for (auto &c : key) {
+        c = static_cast<char>(1 + rng() % 6);
+      }
+      return key;
+    };
+    for (int i = 0; i < 3000; i++) {
+      std::string key = random_key();
+      tree.insert_or_assign(key, std::to_string(i));
+      expect[key] = std::to_string(i);
+    }
+
+    auto first = tree.snapshot();
+    auto first_expect = expect;
+    // overwrites in place, grows, splits, erases and merges
+    for (int i = 0; i < 3000; i++) {
+      std::string key = random_key();
+      if (i % 3 == 0) {
+        tree.erase(key);
+        expect.erase(key);
+      } else {
+        tree.insert_or_assign(key, "v" + std::to_string(i));
+        expect[key] = "v" + std::to_string(i);
+      }
+    }
+    auto second = tree.snapshot();
+    auto second_expect = expect;
+    tree.update(expect.begin()->first, [](auto) { return std::string("u"); });
+    expect.begin()->second = "u";
+    for (auto it = expect.begin(); it != expect.end();) {
+      tree.erase(it->first);
+      it = expect.erase(it);
+      if (it != expect.end()) {
+        ++it;
+      }
+    }
+
+    ASSERT_EQ(dump(*first), first_expect);
+    ASSERT_EQ(first->size(), first_expect.size());
+    ASSERT_EQ(dump(*second), second_expect);
+    ASSERT_EQ(dump(tree), expect);
+    ASSERT_EQ(tree.size(), expect.size());
+    std::string_view val;
+    ASSERT_TRUE(first->search(first_expect.begin()->first, val));
+    ASSERT_EQ(val, first_expect.begin()->second);
+
+    // once the snapshots are gone and a write reclaimed them, nothing is
+    // shared any more
+    first.reset();
+    second.reset();
+    tree.insert_or_assign("\x01", "x");
+    expect["\x01"] = "x";
+    std::function<void(Node *)> unshared = [&](Node *n) {
+      ASSERT_FALSE(ArtTree::is_shared(n));
+      if (!Node::is_leaf(n)) {
+        n->for_each_child([&](Node *child, unsigned char) { unshared(child); });
+      }
+    };
+    unshared(tree.root_);
+    ASSERT_EQ(dump(tree), expect);
+  }
+}
+
+TEST(NodeTest, concurrent_snapshot_test) {
+  ArtTree tree(AllocPolicy::Heap);
+  for (int i = 0; i < 5000; i++) {
+    tree.insert_or_assign("key" + std::to_string(i), std::to_string(i));
+  }
+  auto snap = tree.snapshot();
+  std::atomic<bool> done{false};
+  // a long scan of the snapshot while the tree keeps changing
+  std::thread reader([&] {
+    while (!done.load()) {
+      size_t n = 0;
+      for (auto it = snap->begin(); it != snap->end(); ++it) {
+        EXPECT_EQ(it.key().substr(3), it.value());
+        n++;
+      }
+      EXPECT_EQ(n, 5000);
+    }
+  });
+  for (int round = 0; round < 5; round++) {
+    for (int i = 0; i < 5000; i += 2) {
+      tree.erase("key" + std::to_string(i));
+      tree.insert_or_assign("key" + std::to_string(i + 1), "x");
+      tree.insert_or_assign("new" + std::to_string(i), "y");
+    }
+    // snapshots come and go on the writer side too
+    tree.snapshot();
+  }
+  done = true;
+  reader.join();
+}
+
+TEST(NodeTest, nul_key_test) {
+  // the end of "a" and the 0 byte of "a\0b" would share child slot 0
+  ASSERT_TRUE(valid_key("abc"));
+  ASSERT_TRUE(valid_key(""));
+  ASSERT_FALSE(valid_key(std::string_view("a\0b", 3)));
+  std::string_view bad("a\0b", 3);
+  ArtTree tree;
+  ASSERT_TRUE(tree.insert_or_assign("a", "1"));
+  // refused in every build, nothing is stored
+  ASSERT_FALSE(tree.insert(bad, "2"));
+  ASSERT_FALSE(tree.insert_or_assign(bad, "2"));
+  ASSERT_FALSE(tree.insert_if_absent(bad, "2"));
+  ASSERT_FALSE(tree.try_emplace(bad, "2"));
+  bool called = false;
+  ASSERT_FALSE(tree.update(bad, [&](auto) {
+    called = true;
+    return std::string("2");
+  }));
+  ASSERT_FALSE(called);
+  ASSERT_EQ(tree.size(), 1);
+  std::string_view val;
+  ASSERT_TRUE(tree.search("a", val));
+  ASSERT_EQ(val, "1");
+  ASSERT_FALSE(tree.search(bad, val));
+
+  // bulk loads skip the pair
+  std::vector<std::pair<std::string, std::string>> sorted = {
+      {"a", "1"}, {std::string(bad), "2"}, {"b", "3"}};
+  ArtTree bulk;
+  bulk.bulk_load(sorted);
+  ASSERT_EQ(bulk.size(), 2);
+  ASSERT_EQ(dump(bulk),
+            (std::map<std::string, std::string>{{"a", "1"}, {"b", "3"}}));
+  ArtTree only_bad;
+  only_bad.bulk_load(std::vector<std::pair<std::string, std::string>>{
+      {std::string(bad), "2"}});
+  ASSERT_EQ(only_bad.size(), 0);
+  ASSERT_EQ(only_bad.root_, nullptr);
+  ThreadPool pool(2);
+  ArtTree parallel;
+  parallel.bulk_load(sorted, pool);
+  ASSERT_EQ(dump(parallel), dump(bulk));
+}
+
+static void same_shape(Node *a, Node *b) {
+  ASSERT_EQ(Node::is_leaf(a), Node::is_leaf(b));
+  if (Node::is_leaf(a)) {
+    ASSERT_EQ(Node::to_leaf(a)->load_key(), Node::to_leaf(b)->load_key());
+    ASSERT_EQ(Node::to_leaf(a)->load_val(), Node::to_leaf(b)->load_val());
+    return;
+  }
+  ASSERT_EQ(a->type, b->type);
+  ASSERT_EQ(a->prefix_len, b->prefix_len);
+  ASSERT_EQ(memcmp(a->prefix, b->prefix, a->stored_prefix_len()), 0);
+  std::vector<std::pair<unsigned char, Node *>> ca, cb;
+  a->for_each_child([&](Node *c, unsigned char ch) { ca.emplace_back(ch, c); });
+  b->for_each_child([&](Node *c, unsigned char ch) { cb.emplace_back(ch, c); });
+  ASSERT_EQ(ca.size(), cb.size());
+  for (size_t i = 0; i < ca.size(); i++) {
+    ASSERT_EQ(ca[i].first, cb[i].first);
+    same_shape(ca[i].second, cb[i].second);
+  }
+}
+
+TEST(NodeTest, save_load_test) {
+  std::string path = ::testing::TempDir() + "art_save_load_test.bin";
+  ArtTree tree;
+  std::mt19937 rng(25);
+  for (int i = 0; i < 20000; i++) {
+    // long shared prefixes and every node type
+    std::string key = i % 3 ? "a/very/long/shared/prefix/" : "";
+    size_t len = 1 + rng() % 8;
+    for (size_t j = 0; j < len; j++) {
+      key.push_back(static_cast<char>(1 + rng() % (j % 2 ? 3 : 255)));
+    }
+    tree.insert_or_assign(key, std::string(rng() % 20, 'v'));
+  }
+  for (int i = 0; i < 5000; i++) {
+    tree.erase(tree.begin().key());
+  }
+  ASSERT_TRUE(tree.save(path));
+
+  ArtTree loaded;
+  ASSERT_TRUE(loaded.load(path));
+  ASSERT_EQ(loaded.size(), tree.size());
+  same_shape(tree.root_, loaded.root_);
+  ASSERT_EQ(dump(loaded), dump(tree));
+  // only into an empty tree
+  ASSERT_FALSE(loaded.load(path));
+
+  // a loaded tree is an ordinary tree
+  loaded.insert_or_assign("new", "1");
+  ASSERT_TRUE(loaded.erase("new"));
+
+  // any flipped byte or a cut fails the load and leaves the tree empty
+  std::string image;
+  {
+    std::ifstream in(path, std::ios::binary);
+    image.assign(std::istreambuf_iterator<char>(in), {});
+  }
+  auto write = [&](const std::string &bytes) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), bytes.size());
+  };
+  for (size_t pos : {size_t{0}, size_t{12}, size_t{50}, image.size() / 2,
+                     image.size() - 1}) {
+    std::string bad = image;
+    bad[pos] ^= 0x5a;
+    write(bad);
+    ArtTree other;
+    ASSERT_FALSE(other.load(path)) << pos;
+    ASSERT_EQ(other.size(), 0);
+    ASSERT_EQ(other.root_, nullptr);
+  }
+  write(image.substr(0, image.size() - 7));
+  ArtTree cut;
+  ASSERT_FALSE(cut.load(path));
+  ArtTree missing;
+  ASSERT_FALSE(missing.load(path + ".missing"));
+
+  // the empty tree and a single leaf
+  ArtTree empty;
+  ASSERT_TRUE(empty.save(path));
+  ArtTree empty2;
+  ASSERT_TRUE(empty2.load(path));
+  ASSERT_EQ(empty2.size(), 0);
+  empty.insert_or_assign("only", "one");
+  ASSERT_TRUE(empty.save(path));
+  ArtTree single(AllocPolicy::Heap);
+  ASSERT_TRUE(single.load(path));
+  std::string_view val;
+  ASSERT_TRUE(single.search("only", val));
+  ASSERT_EQ(val, "one");
+  std::remove(path.c_str());
+}
+
+TEST(NodeTest, save_refuse_test) {
+  std::string path = ::testing::TempDir() + "art_save_refuse_test.bin";
+  ArtTree good;
+  good.insert_or_assign("good", "1");
+  ASSERT_TRUE(good.save(path));
+
+  // the shape inserting "a\0b", "a\0c" and "a" builds without the key
+  // check: byte 0 leads both to "a" and to the node below "a\0"
+  using namespace std::literals;
+  auto leaf = [](ArtTree &tree, std::string_view key) {
+    return Node::make_node(NodeType::Leaf, key, "v", tree.alloc_);
+  };
+  ArtTree bad;
+  Node *inner = Node::make_node(NodeType::Node4, "", "", bad.alloc_);
+  inner->add_child('b', leaf(bad, "a\0b"sv));
+  inner->add_child('c', leaf(bad, "a\0c"sv));
+  Node *root = Node::make_node(NodeType::Node4, "", "", bad.alloc_);
+  root->set_prefix((const unsigned char *)"a", 1);
+  root->add_child(0, leaf(bad, "a"));
+  root->add_child(0, inner);
+  bad.root_ = root;
+  bad.size_ = 3;
+  ASSERT_FALSE(bad.save(path));
+
+  // a single key with a 0 byte is refused as well
+  ArtTree single;
+  single.root_ = leaf(single, "x\0y"sv);
+  single.size_ = 1;
+  ASSERT_FALSE(single.save(path));
+
+  // so does a save that cannot write its image
+  std::filesystem::create_directory(path + ".tmp");
+  good.insert_or_assign("lost", "2");
+  ASSERT_FALSE(good.save(path));
+  ASSERT_TRUE(std::filesystem::is_directory(path + ".tmp"));
+  std::filesystem::remove(path + ".tmp");
+  ASSERT_FALSE(good.save(::testing::TempDir() + "missing/art.bin"));
+
+  // the refused saves left the earlier image alone
+  ArtTree loaded;
+  ASSERT_TRUE(loaded.load(path));
+  std::string_view val;
+  ASSERT_TRUE(loaded.search("good", val));
+  ASSERT_FALSE(loaded.search("lost", val));
+
+  // a good save replaces it and leaves nothing beside it
+  ASSERT_TRUE(good.save(path));
+  ASSERT_FALSE(std::filesystem::exists(path + ".tmp"));
+  ArtTree replaced;
+  ASSERT_TRUE(replaced.load(path));
+  ASSERT_TRUE(replaced.search("lost", val));
+  std::remove(path.c_str());
 }
 
 int main(int, char **) {
@@ -0,0 +1,210 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <map>
+#include <random>
+#include <thread>
+#define private public
+#include "../art_olc.hpp"
+
+using namespace arttree;
+
+static std::string make_key(std::mt19937 &rng) {
+  // long shared prefixes exercise the splits that read a leaf
+  static const std::string prefixes[] = {"", "tenant/",
+                                         "tenant/0123456789abcdef/",
+                                         "tenant/0123456789abcdefgh/"};
+  std::string key = prefixes[rng() % 4];
+  size_t len = 1 + rng() % 8;
+  for (size_t j = 0; j < len; j++) {
+    key.push_back(1 + rng() % (j % 2 ? 4 : 255));
+  }
+  return key;
+}
+
+TEST(OlcTest, single_thread_test) {
+  OlcArtTree tree;
+  std::map<std::string, std::string> expect;
+  std::mt19937 rng(19);
+  for (int i = 0; i < 30000; i++) {
+    std::string key = make_key(rng);
+    bool created = expect.find(key) == expect.end();
+    ASSERT_EQ(tree.insert(key, std::to_string(i)), created);
+    expect[key] = std::to_string(i);
+  }
+  ASSERT_EQ(tree.size(), expect.size());
+  for (auto &[k, v] : expect) {
+    std::string_view val;
+    ASSERT_TRUE(tree.search(k, val));
+    ASSERT_EQ(val, v);
+  }
+
+  // erase most keys, so nodes shrink and merge
+  size_t n = 0;
+  for (auto it = expect.begin(); it != expect.end();) {
+    if (n++ % 10 == 0) {
+      ++it;
+      continue;
+    }
+    ASSERT_TRUE(tree.erase(it->first));
+    ASSERT_FALSE(tree.erase(it->first));
+    it = expect.erase(it);
+  }
+  ASSERT_EQ(tree.size(), expect.size());
+  for (auto &[k, v] : expect) {
+    std::string_view val;
+    ASSERT_TRUE(tree.search(k, val)) << k;
+    ASSERT_EQ(val, v);
+  }
+  std::string_view val;
+  ASSERT_FALSE(tree.search("missing", val));
+  // the locks are all released
+  std::function<void(Node *)> unlocked = [&](Node *n) {
+    if (Node::is_leaf(n)) {
+      return;
+    }
+    ASSERT_EQ(n->version.load() & (OptLock::LOCKED | OptLock::OBSOLETE), 0);
+    n->for_each_child([&](Node *child, unsigned char) { unlocked(child); });
+  };
+  unlocked(tree.root_);
+}
+
+TEST(OlcTest, concurrent_test) {
+  OlcArtTree tree;
+  constexpr int THREADS = 4;
+  constexpr int KEYS = 20000;
+  std::vector<std::vector<std::string>> keys(THREADS);
+  std::mt19937 rng(20);
+  for (int t = 0; t < THREADS; t++) {
+    for (int i = 0; i < KEYS; i++) {
+      // each thread owns the keys ending in its id
+      keys[t].push_back(make_key(rng) + static_cast<char>('a' + t));
+    }
+  }
+  // shared keys every thread keeps overwriting
+  std::vector<std::string> shared;
+  for (int i = 0; i < 100; i++) {
+    shared.push_back("shared/" + std::to_string(i));
+    tree.insert(shared.back(), "init");
+  }
+
+  std::atomic<bool> failed{false};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < THREADS; t++) {
+    threads.emplace_back([&, t] {
+      std::mt19937 local(t);
+      std::string_view val;
+      for (int i = 0; i < KEYS; i++) {
+        const std::string &key = keys[t][i];
+        tree.insert(key, key);
+        if (!tree.search(key, val) || val != key) {
+          failed = true;
+        }
+        tree.insert(shared[local() % shared.size()], std::to_string(t));
+        if (!tree.search(shared[local() % shared.size()], val)) {
+          failed = true;
+        }
+        if (i % 3 == 0) {
+          // erase an earlier key of this thread
+          const std::string &old = keys[t][local() % (i + 1)];
+          tree.erase(old);
+          if (tree.search(old, val)) {
+            failed = true;
+          }
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  ASSERT_FALSE(failed.load());
+
+  // replay each thread serially to know which of its keys survive
+  std::map<std::string, std::string> expect;
+  for (auto &s : shared) {
+    expect[s];
+  }
+  for (int t = 0; t < THREADS; t++) {
+    std::mt19937 local(t);
+    for (int i = 0; i < KEYS; i++) {
+      expect[keys[t][i]] = keys[t][i];
+      local();
+      local();
+      if (i % 3 == 0) {
+        expect.erase(keys[t][local() % (i + 1)]);
+      }
+    }
+  }
+  ASSERT_EQ(tree.size(), expect.size());
+  for (auto &[k, v] : expect) {
+    std::string_view val;
+    ASSERT_TRUE(tree.search(k, val)) << k;
+    if (k.rfind("shared/", 0) != 0) {
+      ASSERT_EQ(val, v);
+    }
+  }
+}
+
+TEST(OlcTest, prefix_rewrite_test) {
+  // "pabcdefgh1" and "pabcdefgh2" sit below a node with prefix
+  // "abcdefgh"; inserting "pabcZ" splits that prefix in place and erasing
+  // it merges it back, while readers and a writer keep going through it
+  OlcArtTree tree;
+  std::vector<std::string> stable;
+  for (int i = 0; i < 8; i++) {
+    stable.push_back("pabcdefgh" + std::to_string(i));
+    tree.insert(stable.back(), stable.back());
+  }
+  constexpr int ROUNDS = 100000;
+  std::atomic<bool> done{false};
+  std::atomic<bool> failed{false};
+  std::vector<std::thread> threads;
+  threads.emplace_back([&] {
+    for (int i = 0; i < ROUNDS; i++) {
+      tree.insert("pabcZ", "z");
+      tree.erase("pabcZ");
+    }
+    done = true;
+  });
+  // a writer that must land below the node, not beside it
+  threads.emplace_back([&] {
+    std::string_view val;
+    while (!done) {
+      tree.insert("pabcdefgh9", "9");
+      if (!tree.search("pabcdefgh9", val) || !tree.erase("pabcdefgh9")) {
+        failed = true;
+      }
+    }
+  });
+  for (int t = 0; t < 2; t++) {
+    threads.emplace_back([&, t] {
+      std::string_view val;
+      for (size_t i = t; !done; i++) {
+        const std::string &key = stable[i % stable.size()];
+        if (!tree.search(key, val) || val != key) {
+          failed = true;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  ASSERT_FALSE(failed.load());
+  ASSERT_EQ(tree.size(), stable.size());
+  for (auto &key : stable) {
+    std::string_view val;
+    ASSERT_TRUE(tree.search(key, val));
+  }
+}
+
+TEST(OlcTest, invalid_key_test) {
+  OlcArtTree tree;
+  ASSERT_FALSE(tree.insert(std::string_view("a\0b", 3), "v"));
+  ASSERT_EQ(tree.size(), 0);
+}
+
+int main(int, char **) {
+  ::testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,187 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <map>
+#include <random>
+#include <thread>
+#define private public
+#include "../art_rowex.hpp"
+
+using namespace arttree;
+
+static std::string make_key(std::mt19937 &rng) {
+  // long shared prefixes exercise the splits that read a leaf
+  static const std::string prefixes[] = {"", "tenant/",
+                                         "tenant/0123456789abcdef/",
+                                         "tenant/0123456789abcdefgh/"};
+  std::string key = prefixes[rng() % 4];
+  size_t len = 1 + rng() % 8;
+  for (size_t j = 0; j < len; j++) {
+    key.push_back(1 + rng() % (j % 2 ? 4 : 255));
+  }
+  return key;
+}
+
+TEST(RowexTest, single_thread_test) {
+  RowexArtTree tree;
+  std::map<std::string, std::string> expect;
+  std::mt19937 rng(23);
+  for (int i = 0; i < 30000; i++) {
+    std::string key = make_key(rng);
+    bool created = expect.find(key) == expect.end();
+    ASSERT_EQ(tree.insert(key, std::to_string(i)), created);
+    expect[key] = std::to_string(i);
+  }
+  ASSERT_EQ(tree.size(), expect.size());
+  for (auto &[k, v] : expect) {
+    std::string_view val;
+    ASSERT_TRUE(tree.search(k, val));
+    ASSERT_EQ(val, v);
+  }
+
+  // erase most keys, so nodes shrink and merge
+  size_t n = 0;
+  for (auto it = expect.begin(); it != expect.end();) {
+    if (n++ % 10 == 0) {
+      ++it;
+      continue;
+    }
+    ASSERT_TRUE(tree.erase(it->first));
+    ASSERT_FALSE(tree.erase(it->first));
+    it = expect.erase(it);
+  }
+  ASSERT_EQ(tree.size(), expect.size());
+  for (auto &[k, v] : expect) {
+    std::string_view val;
+    ASSERT_TRUE(tree.search(k, val)) << k;
+    ASSERT_EQ(val, v);
+  }
+  std::string_view val;
+  ASSERT_FALSE(tree.search("missing", val));
+  // the locks are all released
+  std::function<void(Node *)> unlocked = [&](Node *n) {
+    if (Node::is_leaf(n)) {
+      return;
+    }
+    ASSERT_EQ(n->version.load() & (OptLock::LOCKED | OptLock::OBSOLETE), 0);
+    n->for_each_child([&](Node *child, unsigned char) { unlocked(child); });
+  };
+  unlocked(tree.root_);
+}
+
+TEST(RowexTest, concurrent_test) {
+  RowexArtTree tree;
+  constexpr int THREADS = 4;
+  constexpr int KEYS = 20000;
+  std::vector<std::vector<std::string>> keys(THREADS);
+  std::mt19937 rng(20);
+  for (int t = 0; t < THREADS; t++) {
+    for (int i = 0; i < KEYS; i++) {
+      // each thread owns the keys ending in its id
+      keys[t].push_back(make_key(rng) + static_cast<char>('a' + t));
+    }
+  }
+  // shared keys every thread keeps overwriting
+  std::vector<std::string> shared;
+  for (int i = 0; i < 100; i++) {
+    shared.push_back("shared/" + std::to_string(i));
+    tree.insert(shared.back(), "init");
+  }
+
+  // stable keys are never touched, a lookup must find them at any moment
+  std::vector<std::string> stable;
+  for (int i = 0; i < 1000; i++) {
+    stable.push_back(make_key(rng) + "stable");
+    tree.insert(stable.back(), stable.back());
+  }
+
+  std::atomic<bool> failed{false};
+  std::atomic<bool> done{false};
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 2; r++) {
+    readers.emplace_back([&] {
+      std::string_view val;
+      while (!done.load()) {
+        for (auto &key : stable) {
+          if (!tree.search(key, val) || val != key) {
+            failed = true;
+          }
+        }
+      }
+    });
+  }
+  std::vector<std::thread> threads;
+  for (int t = 0; t < THREADS; t++) {
+    threads.emplace_back([&, t] {
+      std::mt19937 local(t);
+      std::string_view val;
+      for (int i = 0; i < KEYS; i++) {
+        const std::string &key = keys[t][i];
+        tree.insert(key, key);
+        if (!tree.search(key, val) || val != key) {
+          failed = true;
+        }
+        tree.insert(shared[local() % shared.size()], std::to_string(t));
+        if (!tree.search(shared[local() % shared.size()], val)) {
+          failed = true;
+        }
+        if (i % 3 == 0) {
+          // erase an earlier key of this thread
+          const std::string &old = keys[t][local() % (i + 1)];
+          tree.erase(old);
+          if (tree.search(old, val)) {
+            failed = true;
+          }
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  done = true;
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  ASSERT_FALSE(failed.load());
+
+  // replay each thread serially to know which of its keys survive
+  std::map<std::string, std::string> expect;
+  for (auto &s : shared) {
+    expect[s];
+  }
+  for (auto &s : stable) {
+    expect[s] = s;
+  }
+  for (int t = 0; t < THREADS; t++) {
+    std::mt19937 local(t);
+    for (int i = 0; i < KEYS; i++) {
+      expect[keys[t][i]] = keys[t][i];
+      local();
+      local();
+      if (i % 3 == 0) {
+        expect.erase(keys[t][local() % (i + 1)]);
+      }
+    }
+  }
+  ASSERT_EQ(tree.size(), expect.size());
+  for (auto &[k, v] : expect) {
+    std::string_view val;
+    ASSERT_TRUE(tree.search(k, val)) << k;
+    if (k.rfind("shared/", 0) != 0) {
+      ASSERT_EQ(val, v);
+    }
+  }
+}
+
+TEST(RowexTest, invalid_key_test) {
+  RowexArtTree tree;
+  std::string_view bad("a\0b", 3);
+  ASSERT_FALSE(tree.insert(bad, "v"));
+  ASSERT_FALSE(tree.insert_if_absent(bad, "v"));
+  ASSERT_EQ(tree.size(), 0);
+}
+
+int main(int, char **) {
+  ::testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,155 @@
+#include <gtest/gtest.h>
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+#define private public
+#include "../sharded_art.hpp"
+
+using namespace arttree;
+
+template <size_t N>
+static void check_scan(const ShardedArtTree<N> &tree,
+                       const std::map<std::string, std::string> &expect) {
+  auto it = expect.begin();
+  tree.scan("", [&](std::string_view k, std::string_view v) {
+    EXPECT_NE(it, expect.end());
+    EXPECT_EQ(k, it->first);
+    EXPECT_EQ(v, it->second);
+    ++it;
+    return true;
+  });
+  ASSERT_EQ(it, expect.end());
+
+  // from the middle, and stopping early
+  auto from = std::next(expect.begin(), expect.size() / 2);
+  size_t visited = 0;
+  bool all = tree.scan(from->first, [&](std::string_view k, std::string_view) {
+    EXPECT_EQ(k, from->first);
+    ++from;
+    return ++visited < 10;
+  });
+  ASSERT_FALSE(all);
+  ASSERT_EQ(visited, 10);
+}
+
+TEST(ShardedTest, range_test) {
+  ShardedArtTree<8> tree;
+  std::map<std::string, std::string> expect;
+  std::mt19937 rng(22);
+  for (int i = 0; i < 20000; i++) {
+    std::string key(1 + rng() % 8, 0);
+    for (auto &c : key) {
+      // no zero bytes, a key may not extend another by byte 0
+      c = static_cast<char>(1 + rng() % 255);
+    }
+    tree.insert_or_assign(key, std::to_string(i));
+    expect[key] = std::to_string(i);
+  }
+  ASSERT_EQ(tree.size(), expect.size());
+  // keys are spread over the shards in order of their first byte
+  for (size_t i = 0; i < 8; i++) {
+    ASSERT_GT(tree.shards_[i]->tree.size(), 0);
+  }
+  ASSERT_EQ(tree.shard_of(""), 0);
+  ASSERT_EQ(tree.shard_of("\xff"), 7);
+  check_scan(tree, expect);
+
+  for (auto it = expect.begin(); it != expect.end();) {
+    ASSERT_TRUE(tree.erase(it->first));
+    it = expect.erase(it);
+    if (it != expect.end()) {
+      ++it;
+    }
+  }
+  ASSERT_EQ(tree.size(), expect.size());
+  std::string val;
+  for (auto &[k, v] : expect) {
+    ASSERT_TRUE(tree.search(k, val));
+    ASSERT_EQ(val, v);
+  }
+  check_scan(tree, expect);
+}
+
+TEST(ShardedTest, hash_test) {
+  ShardedArtTree<4> tree(ShardMode::Hash);
+  std::map<std::string, std::string> expect;
+  // one shared prefix, range routing would put everything in one shard
+  for (int i = 0; i < 10000; i++) {
+    std::string key = "user/" + std::to_string(i * 7919 % 10007);
+    tree.insert_or_assign(key, std::to_string(i));
+    expect[key] = std::to_string(i);
+  }
+  ASSERT_EQ(tree.size(), expect.size());
+  for (size_t i = 0; i < 4; i++) {
+    ASSERT_GT(tree.shards_[i]->tree.size(), 1000);
+  }
+  check_scan(tree, expect);
+  ASSERT_FALSE(tree.insert_if_absent("user/1", "x"));
+  ASSERT_FALSE(tree.update("user/1", [](auto) { return std::string("y"); }));
+  std::string val;
+  ASSERT_TRUE(tree.search("user/1", val));
+  ASSERT_EQ(val, "y");
+}
+
+TEST(ShardedTest, custom_router_test) {
+  // two bytes of routing, keys below "m" to shard 0
+  ShardedArtTree<2> tree(ShardMode::Range, [](std::string_view key) {
+    return key.empty() || key[0] < 'm' ? size_t{0} : size_t{1};
+  });
+  tree.insert_or_assign("apple", "1");
+  tree.insert_or_assign("zebra", "2");
+  tree.insert_or_assign("mango", "3");
+  ASSERT_EQ(tree.shards_[0]->tree.size(), 1);
+  ASSERT_EQ(tree.shards_[1]->tree.size(), 2);
+  std::vector<std::string> keys;
+  tree.scan("b", [&](std::string_view k, std::string_view) {
+    keys.emplace_back(k);
+    return true;
+  });
+  ASSERT_EQ(keys, (std::vector<std::string>{"mango", "zebra"}));
+}
+
+TEST(ShardedTest, concurrent_test) {
+  ShardedArtTree<8> tree;
+  constexpr int THREADS = 4;
+  constexpr int KEYS = 10000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < THREADS; t++) {
+    threads.emplace_back([&, t] {
+      std::mt19937 rng(t);
+      for (int i = 0; i < KEYS; i++) {
+        std::string key = std::to_string(rng()) + static_cast<char>('a' + t);
+        tree.insert_or_assign(key, key);
+        std::string val;
+        EXPECT_TRUE(tree.search(key, val));
+        EXPECT_EQ(val, key);
+      }
+    });
+  }
+  // a scan in between sees sorted keys
+  std::string last;
+  tree.scan("", [&](std::string_view k, std::string_view) {
+    EXPECT_LT(last, k);
+    last = k;
+    return true;
+  });
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  ASSERT_EQ(tree.size(), THREADS * KEYS);
+}
+
+TEST(ShardedTest, invalid_key_test) {
+  ShardedArtTree<4> tree(ShardMode::Hash);
+  std::string_view bad("a\0b", 3);
+  ASSERT_FALSE(tree.insert_or_assign(bad, "v"));
+  ASSERT_FALSE(tree.insert_if_absent(bad, "v"));
+  ASSERT_FALSE(tree.update(bad, [](auto) { return std::string("v"); }));
+  ASSERT_EQ(tree.size(), 0);
+}
+
+int main(int, char **) {
+  ::testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}